@@ -70,6 +70,8 @@ _services: dict[str, tuple] = {
   "navThumbnail": (True, 0.),
   "qRoadEncodeIdx": (False, 20.),
   "userFlag": (True, 0., 1),
+  "loggerdStats": (True, 1., 60),
+  "pandadSendStats": (True, 1., 60),
   "microphone": (True, 10., 10),
 
   # debug
@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+# Measures drops and latency of CAN from pandad running against simulated pandas:
+#   PANDA_SIM=1 BOARDD_SKIP_FW_CHECK=1 ./selfdrive/pandad/pandad
+import argparse
+import struct
+import time
+from collections import defaultdict
+
+import numpy as np
+
+import cereal.messaging as messaging
+
+
+def pandad_sim_stats(interval):
+  can_sock = messaging.sub_sock('can', conflate=False, timeout=100)
+
+  last_seq = {}
+  received, dropped = defaultdict(int), defaultdict(int)
+  latencies = []
+  last_print = time.monotonic()
+  while True:
+    for msg in messaging.drain_sock(can_sock, wait_for_one=True):
+      now_us = msg.logMonoTime // 1000
+      for c in msg.can:
+        if len(c.dat) < 8 or c.src >= 128:
+          continue
+        panda = c.src // 4
+        seq, sent_us = struct.unpack('<II', c.dat[:8])
+        if panda in last_seq and seq > last_seq[panda] + 1:
+          dropped[panda] += seq - last_seq[panda] - 1
+        last_seq[panda] = seq
+        received[panda] += 1
+        latencies.append(((now_us & 0xFFFFFFFF) - sent_us) & 0xFFFFFFFF)
+
+    if time.monotonic() - last_print > interval:
+      elapsed = time.monotonic() - last_print
+      if latencies:
+        lat = np.array(latencies) / 1000.
+        print(f"latency ms: p50 {np.percentile(lat, 50):.2f}, p99 {np.percentile(lat, 99):.2f}, max {lat.max():.2f}")
+      for panda in sorted(received):
+        print(f"  panda {panda}: {received[panda] / elapsed:.0f} frames/s, dropped {dropped[panda]}")
+      received.clear()
+      dropped.clear()
+      latencies.clear()
+      last_print = time.monotonic()
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="drops and latency of CAN from simulated pandas")
+  parser.add_argument("--interval", type=float, default=5., help="seconds between reports")
+  args = parser.parse_args()
+  pandad_sim_stats(args.interval)
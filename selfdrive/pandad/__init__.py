@@ -1,7 +1,8 @@
 # Cython, now uses scons to build
-from openpilot.selfdrive.pandad.pandad_api_impl import can_list_to_can_capnp, can_capnp_to_list
+from openpilot.selfdrive.pandad.pandad_api_impl import can_list_to_can_capnp, can_capnp_to_list, CanColumnsParser
 assert can_list_to_can_capnp
 assert can_capnp_to_list
+assert CanColumnsParser
 
 def can_capnp_to_can_list(can, src_filter=None):
   ret = []
@@ -1,6 +1,5 @@
 #include "cereal/messaging/messaging.h"
 #include "selfdrive/pandad/panda.h"
-#include "opendbc/can/common.h"
 
 void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::string &out, bool sendcan, bool valid) {
   MessageBuilder msg;
@@ -11,7 +10,7 @@ void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::stri
   for (auto it = can_list.begin(); it != can_list.end(); it++, j++) {
     auto c = canData[j];
     c.setAddress(it->address);
-    c.setDat(kj::arrayPtr((uint8_t*)it->dat.data(), it->dat.size()));
+    c.setDat(kj::arrayPtr(it->dat, it->size));
     c.setSrc(it->src);
   }
   const uint64_t msg_size = capnp::computeSerializedSizeInWords(msg) * sizeof(capnp::word);
@@ -20,32 +19,45 @@ void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::stri
   capnp::writeMessage(output_stream, msg);
 }
 
-// Converts a vector of Cap'n Proto serialized can strings into a vector of CanData structures.
-void can_capnp_to_can_list_cpp(const std::vector<std::string> &strings, std::vector<CanData> &can_list, bool sendcan) {
+// CAN frames of one or more messages as columns. The frames of message m are
+// [frame_offsets[m], frame_offsets[m + 1]), the payload of frame i is
+// dat[dat_offsets[i], dat_offsets[i + 1]). Reused across calls, so parsing
+// doesn't allocate once the columns have grown to the usual batch size.
+struct CanColumns {
+  std::vector<uint64_t> nanos;
+  std::vector<uint32_t> frame_offsets = {0};
+  std::vector<uint32_t> addresses;
+  std::vector<uint8_t> buses;
+  std::vector<uint32_t> dat_offsets = {0};
+  std::vector<uint8_t> dat;
   AlignedBuffer aligned_buf;
-  can_list.reserve(strings.size());
 
-  for (const auto &str : strings) {
-    // extract the messages
-    capnp::FlatArrayMessageReader reader(aligned_buf.align(str.data(), str.size()));
-    cereal::Event::Reader event = reader.getRoot<cereal::Event>();
-
-    auto frames = sendcan ? event.getSendcan() : event.getCan();
-
-    // Add new CanData entry
-    CanData &can_data = can_list.emplace_back();
-    can_data.nanos = event.getLogMonoTime();
-    can_data.frames.reserve(frames.size());
-
-    // Populate CAN frames
-    for (const auto &frame : frames) {
-      CanFrame &can_frame = can_data.frames.emplace_back();
-      can_frame.src = frame.getSrc();
-      can_frame.address = frame.getAddress();
-
-      // Copy CAN data
-      auto dat = frame.getDat();
-      can_frame.dat.assign(dat.begin(), dat.end());
-    }
+  void clear() {
+    nanos.clear();
+    frame_offsets.assign(1, 0);
+    addresses.clear();
+    buses.clear();
+    dat_offsets.assign(1, 0);
+    dat.clear();
+  }
+};
+
+// Appends the frames of a Cap'n Proto serialized can or sendcan message to the columns.
+void can_capnp_to_can_columns_cpp(const char *data, size_t size, CanColumns &columns, bool sendcan) {
+  // only realign messages that aren't word aligned already
+  const bool aligned = ((uintptr_t)data % sizeof(capnp::word) == 0) && (size % sizeof(capnp::word) == 0);
+  capnp::FlatArrayMessageReader reader(aligned ? kj::arrayPtr((const capnp::word *)data, size / sizeof(capnp::word))
+                                               : columns.aligned_buf.align(data, size));
+  cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+  auto frames = sendcan ? event.getSendcan() : event.getCan();
+
+  columns.nanos.push_back(event.getLogMonoTime());
+  for (const auto &frame : frames) {
+    auto dat = frame.getDat();
+    columns.addresses.push_back(frame.getAddress());
+    columns.buses.push_back(frame.getSrc());
+    columns.dat.insert(columns.dat.end(), dat.begin(), dat.end());
+    columns.dat_offsets.push_back(columns.dat.size());
   }
+  columns.frame_offsets.push_back(columns.addresses.size());
 }
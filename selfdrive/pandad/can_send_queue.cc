@@ -0,0 +1,124 @@
+#include "selfdrive/pandad/pandad.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "common/swaglog.h"
+#include "common/timing.h"
+
+// frames older than this are not sent anymore
+const uint64_t CAN_SEND_TIMEOUT_NS = 1e9;
+
+void CanSendQueue::push(const std::vector<can_frame> &frames, uint64_t mono_time) {
+  // only coalesce when frames from earlier sendcan messages are still waiting,
+  // frames within one message always go out as they are, in order
+  const bool backed_up = pending();
+  batch_++;
+
+  for (const auto &f : frames) {
+    // check if the message is intended for this panda
+    if (f.src < panda_->bus_offset || f.src >= panda_->bus_offset + PANDA_BUS_OFFSET) {
+      continue;
+    }
+    stats.queued++;
+
+    const uint64_t key = ((uint64_t)f.src << 32) | (uint32_t)f.address;
+    auto [it, inserted] = latest_.try_emplace(key, 0);
+    if (!inserted && backed_up && it->second >= pending_base_) {
+      // the new frame goes to the back like any other, the old one is skipped
+      PendingFrame &p = pending_[it->second - pending_base_];
+      if (!p.superseded && p.batch != batch_) {
+        p.superseded = true;
+        live_--;
+        stats.coalesced++;
+      }
+    }
+    it->second = pending_base_ + pending_.size();
+    pending_.push_back({.mono_time = mono_time, .batch = batch_, .superseded = false, .frame = f});
+    live_++;
+  }
+  stats.max_depth = std::max<uint32_t>(stats.max_depth, live_);
+}
+
+bool CanSendQueue::send() {
+  if (!unsent_.empty()) {
+    const int written = panda_->can_write(unsent_.data(), unsent_.size());
+    if (written < 0) {
+      drop_unsent(written);
+      return false;
+    }
+    count_written(written);
+    unsent_.erase(unsent_.begin(), unsent_.begin() + written);
+    if (!unsent_.empty()) {
+      stats.backed_up++;
+      return false;
+    }
+  }
+
+  uint8_t send_buf[2 * USB_TX_SOFT_LIMIT];
+  const uint64_t now = nanos_since_boot();
+  while (!pending_.empty()) {
+    uint32_t pos = 0;
+    while (!pending_.empty() && pos < USB_TX_SOFT_LIMIT) {
+      const PendingFrame &p = pending_.front();
+      const uint64_t age = now > p.mono_time ? now - p.mono_time : 0;
+      // superseded frames were counted as coalesced already
+      if (!p.superseded) {
+        live_--;
+        if (age > CAN_SEND_TIMEOUT_NS) {
+          stats.expired++;
+        } else {
+          const can_frame &f = p.frame;
+          assert(f.size <= CAN_FRAME_DATA_SIZE_MAX);
+          uint8_t data_len_code = LEN_TO_DLC[f.size];
+          assert(f.size == dlc_to_len[data_len_code]);
+
+          const uint32_t size = Panda::pack_can_frame(&send_buf[pos], f.address, f.src - panda_->bus_offset, data_len_code, f.dat, f.size);
+          unsent_frames_.push_back(size);
+          pos += size;
+          stats.latency_ms.push_back(age / 1e6);
+        }
+      }
+      pending_.pop_front();
+      pending_base_++;
+    }
+    if (pos == 0) break;
+
+    const int written = panda_->can_write(send_buf, pos);
+    if (written < 0) {
+      drop_unsent(written);
+      return false;
+    }
+    count_written(written);
+    if (written < pos) {
+      // the panda's TX buffer is full, the rest of the chunk goes first next time
+      // so the panda never sees a partial frame
+      unsent_.assign(send_buf + written, send_buf + pos);
+      stats.backed_up++;
+      return false;
+    }
+  }
+  return true;
+}
+
+// a frame counts as sent once all of it is written, a partly written one stays at the front
+void CanSendQueue::count_written(int written) {
+  while (written > 0) {
+    uint8_t &left = unsent_frames_.front();
+    if (written < left) {
+      left -= written;
+      break;
+    }
+    written -= left;
+    unsent_frames_.pop_front();
+    stats.sent++;
+  }
+}
+
+// comms error or disconnected, the frames not fully written are lost
+void CanSendQueue::drop_unsent(int error) {
+  LOGE("CAN send failed with %d, dropped %zu frames", error, unsent_frames_.size());
+  stats.dropped += unsent_frames_.size();
+  unsent_frames_.clear();
+  unsent_.clear();
+}
@@ -13,17 +13,22 @@
 const bool PANDAD_MAXOUT = getenv("PANDAD_MAXOUT") != nullptr;
 
 Panda::Panda(std::string serial, uint32_t bus_offset) : bus_offset(bus_offset) {
-  // try USB first, then SPI
-  try {
-    handle = std::make_unique<PandaUsbHandle>(serial);
-    LOGW("connected to %s over USB", serial.c_str());
-  } catch (std::exception &e) {
+  if (getenv("PANDA_SIM")) {
+    handle = std::make_unique<PandaSimHandle>(serial);
+    LOGW("connected to simulated panda %s", serial.c_str());
+  } else {
+    // try USB first, then SPI
+    try {
+      handle = std::make_unique<PandaUsbHandle>(serial);
+      LOGW("connected to %s over USB", serial.c_str());
+    } catch (std::exception &e) {
 #ifndef __APPLE__
-    handle = std::make_unique<PandaSpiHandle>(serial);
-    LOGW("connected to %s over SPI", serial.c_str());
+      handle = std::make_unique<PandaSpiHandle>(serial);
+      LOGW("connected to %s over SPI", serial.c_str());
 #else
-    throw e;
+      throw e;
 #endif
+    }
   }
 
   hw_type = get_hw_type();
@@ -43,6 +48,10 @@ std::string Panda::hw_serial() {
 }
 
 std::vector<std::string> Panda::list(bool usb_only) {
+  if (getenv("PANDA_SIM")) {
+    return PandaSimHandle::list();
+  }
+
   std::vector<std::string> serials = PandaUsbHandle::list();
 
 #ifndef __APPLE__
@@ -153,63 +162,10 @@ void Panda::set_canfd_non_iso(uint16_t bus, bool non_iso) {
   handle->control_write(0xfc, bus, non_iso);
 }
 
-static uint8_t len_to_dlc(uint8_t len) {
-  if (len <= 8) {
-    return len;
-  }
-  if (len <= 24) {
-    return 8 + ((len - 8) / 4) + ((len % 4) ? 1 : 0);
-  } else {
-    return 11 + (len / 16) + ((len % 16) ? 1 : 0);
-  }
-}
-
-void Panda::pack_can_buffer(const capnp::List<cereal::CanData>::Reader &can_data_list,
-                            std::function<void(uint8_t *, size_t)> write_func) {
-  int32_t pos = 0;
-  uint8_t send_buf[2 * USB_TX_SOFT_LIMIT];
-
-  for (auto cmsg : can_data_list) {
-    // check if the message is intended for this panda
-    uint8_t bus = cmsg.getSrc();
-    if (bus < bus_offset || bus >= (bus_offset + PANDA_BUS_OFFSET)) {
-      continue;
-    }
-    auto can_data = cmsg.getDat();
-    uint8_t data_len_code = len_to_dlc(can_data.size());
-    assert(can_data.size() <= 64);
-    assert(can_data.size() == dlc_to_len[data_len_code]);
-
-    can_header header = {};
-    header.addr = cmsg.getAddress();
-    header.extended = (cmsg.getAddress() >= 0x800) ? 1 : 0;
-    header.data_len_code = data_len_code;
-    header.bus = bus - bus_offset;
-    header.checksum = 0;
-
-    memcpy(&send_buf[pos], (uint8_t *)&header, sizeof(can_header));
-    memcpy(&send_buf[pos + sizeof(can_header)], (uint8_t *)can_data.begin(), can_data.size());
-    uint32_t msg_size = sizeof(can_header) + can_data.size();
-
-    // set checksum
-    ((can_header *) &send_buf[pos])->checksum = calculate_checksum(&send_buf[pos], msg_size);
-
-    pos += msg_size;
-
-    if (pos >= USB_TX_SOFT_LIMIT) {
-      write_func(send_buf, pos);
-      pos = 0;
-    }
-  }
-
-  // send remaining packets
-  if (pos > 0) write_func(send_buf, pos);
-}
-
-void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list) {
-  pack_can_buffer(can_data_list, [=](uint8_t* data, size_t size) {
-    handle->bulk_write(3, data, size, 5);
-  });
+int Panda::can_write(uint8_t *data, size_t size) {
+  int written = handle->bulk_write(3, data, size, 5);
+  // USB reports a lost connection as nothing written, not as an error
+  return connected() ? written : -1;
 }
 
 bool Panda::can_receive(std::vector<can_frame>& out_vec) {
@@ -235,23 +191,28 @@ bool Panda::can_receive(std::vector<can_frame>& out_vec) {
 }
 
 void Panda::can_reset_communications() {
+  // data received before the reset continues the old stream, it would only fail the checksum again
+  handle->flush_rx();
   handle->control_write(0xc0, 0, 0);
 }
 
 bool Panda::unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_frame> &out_vec) {
-  int pos = 0;
+  uint32_t pos = 0;
 
-  while (pos <= size - sizeof(can_header)) {
-    can_header header;
-    memcpy(&header, &data[pos], sizeof(can_header));
+  while (pos + sizeof(can_header) <= size) {
+    // decode the can_header bit fields straight from the bytes, see pack_can_frame
+    const uint8_t bus_dlc = data[pos];
+    uint32_t addr_word;
+    memcpy(&addr_word, &data[pos + 1], sizeof(addr_word));
 
-    const uint8_t data_len = dlc_to_len[header.data_len_code];
-    if (pos + sizeof(can_header) + data_len > size) {
+    const uint8_t data_len = dlc_to_len[bus_dlc >> 4];
+    const uint32_t frame_len = sizeof(can_header) + data_len;
+    if (pos + frame_len > size) {
       // we don't have all the data for this message yet
       break;
     }
 
-    if (calculate_checksum(&data[pos], sizeof(can_header) + data_len) != 0) {
+    if (calculate_checksum(&data[pos], frame_len) != 0) {
       LOGE("Panda CAN checksum failed");
       size = 0;
       can_reset_communications();
@@ -259,21 +220,18 @@ bool Panda::unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_fra
     }
 
     can_frame &canData = out_vec.emplace_back();
-    canData.address = header.addr;
-    canData.src = header.bus + bus_offset;
-    if (header.rejected) {
-      canData.src += CAN_REJECTED_BUS_OFFSET;
-    }
-    if (header.returned) {
-      canData.src += CAN_RETURNED_BUS_OFFSET;
-    }
-
-    canData.dat.assign((char *)&data[pos + sizeof(can_header)], data_len);
-
-    pos += sizeof(can_header) + data_len;
+    canData.address = addr_word >> 3;
+    canData.src = ((bus_dlc >> 1) & 0x7U) + bus_offset +
+                  (addr_word & 0x1U) * CAN_REJECTED_BUS_OFFSET +
+                  ((addr_word >> 1) & 0x1U) * CAN_RETURNED_BUS_OFFSET;
+    canData.size = data_len;
+    memcpy(canData.dat, &data[pos + sizeof(can_header)], data_len);
+
+    pos += frame_len;
   }
 
-  // move the overflowing data to the beginning of the buffer for the next round
+  // move the overflowing data to the beginning of the buffer for the next round,
+  // this is never more than one partial frame
   memmove(data, &data[pos], size - pos);
   size -= pos;
 
@@ -281,8 +239,20 @@ bool Panda::unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_fra
 }
 
 uint8_t Panda::calculate_checksum(uint8_t *data, uint32_t len) {
-  uint8_t checksum = 0U;
-  for (uint32_t i = 0U; i < len; i++) {
+  // XOR 8 bytes at a time and fold the word, then the remaining bytes
+  uint64_t acc = 0U;
+  uint32_t i = 0U;
+  for (; i + sizeof(acc) <= len; i += sizeof(acc)) {
+    uint64_t word;
+    memcpy(&word, &data[i], sizeof(word));
+    acc ^= word;
+  }
+  acc ^= acc >> 32;
+  acc ^= acc >> 16;
+  acc ^= acc >> 8;
+
+  uint8_t checksum = acc & 0xFFU;
+  for (; i < len; i++) {
     checksum ^= data[i];
   }
   return checksum;
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <array>
+#include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <ctime>
-#include <functional>
 #include <list>
 #include <memory>
 #include <optional>
@@ -25,6 +27,8 @@
 
 #define PANDA_BUS_OFFSET 4
 
+#define CAN_FRAME_DATA_SIZE_MAX 64U
+
 struct __attribute__((packed)) can_header {
   uint8_t reserved : 1;
   uint8_t bus : 3;
@@ -36,17 +40,32 @@ struct __attribute__((packed)) can_header {
   uint8_t checksum : 8;
 };
 
+// smallest DLC that fits a payload length, only exact for the valid CAN (FD) lengths
+constexpr std::array<uint8_t, CAN_FRAME_DATA_SIZE_MAX + 1> make_len_to_dlc() {
+  std::array<uint8_t, CAN_FRAME_DATA_SIZE_MAX + 1> table = {};
+  for (uint32_t len = 0; len <= CAN_FRAME_DATA_SIZE_MAX; len++) {
+    if (len <= 8) {
+      table[len] = len;
+    } else if (len <= 24) {
+      table[len] = 8 + ((len - 8) / 4) + ((len % 4) ? 1 : 0);
+    } else {
+      table[len] = 11 + (len / 16) + ((len % 16) ? 1 : 0);
+    }
+  }
+  return table;
+}
+constexpr std::array<uint8_t, CAN_FRAME_DATA_SIZE_MAX + 1> LEN_TO_DLC = make_len_to_dlc();
+
+// POD with an inline payload, so a reused vector of frames receives without allocating
 struct can_frame {
   long address;
-  std::string dat;
   long src;
+  uint8_t size;
+  uint8_t dat[CAN_FRAME_DATA_SIZE_MAX];
 };
 
 
 class Panda {
-private:
-  std::unique_ptr<PandaCommsHandle> handle;
-
 public:
   Panda(std::string serial="", uint32_t bus_offset=0);
 
@@ -79,18 +98,40 @@ public:
   void set_can_speed_kbps(uint16_t bus, uint16_t speed);
   void set_data_speed_kbps(uint16_t bus, uint16_t speed);
   void set_canfd_non_iso(uint16_t bus, bool non_iso);
-  void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
+  // writes packed frames, returns the bytes the panda accepted or a negative error
+  int can_write(uint8_t *data, size_t size);
   bool can_receive(std::vector<can_frame>& out_vec);
+  // upper bound of the frames a single can_receive() adds
+  static constexpr size_t MAX_RECV_FRAMES = (RECV_SIZE + sizeof(can_header) + CAN_FRAME_DATA_SIZE_MAX) / sizeof(can_header);
+  // packs a single frame in the panda's wire format, returns its size
+  static inline uint32_t pack_can_frame(uint8_t *dst, uint32_t addr, uint8_t bus, uint8_t data_len_code, const uint8_t *dat, uint8_t len);
   void can_reset_communications();
 
 protected:
+  std::unique_ptr<PandaCommsHandle> handle;
+
   // for unit tests
-  uint8_t receive_buffer[RECV_SIZE + sizeof(can_header) + 64];
+  uint8_t receive_buffer[RECV_SIZE + sizeof(can_header) + CAN_FRAME_DATA_SIZE_MAX];
   uint32_t receive_buffer_size = 0;
 
   Panda(uint32_t bus_offset) : bus_offset(bus_offset) {}
-  void pack_can_buffer(const capnp::List<cereal::CanData>::Reader &can_data_list,
-                         std::function<void(uint8_t *, size_t)> write_func);
   bool unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_frame> &out_vec);
   uint8_t calculate_checksum(uint8_t *data, uint32_t len);
 };
+
+// Writes the header and payload of a frame in place and returns its size. This is
+// the bit layout of can_header, the checksum is computed while the payload is copied.
+inline uint32_t Panda::pack_can_frame(uint8_t *dst, uint32_t addr, uint8_t bus, uint8_t data_len_code, const uint8_t *dat, uint8_t len) {
+  const uint32_t addr_word = (addr << 3) | ((addr >= 0x800 ? 1U : 0U) << 2);
+  dst[0] = (data_len_code << 4) | (bus << 1);
+  memcpy(&dst[1], &addr_word, sizeof(addr_word));
+
+  uint8_t checksum = dst[0] ^ dst[1] ^ dst[2] ^ dst[3] ^ dst[4];
+  uint8_t *payload = &dst[sizeof(can_header)];
+  for (uint8_t i = 0; i < len; i++) {
+    payload[i] = dat[i];
+    checksum ^= dat[i];
+  }
+  dst[sizeof(can_header) - 1] = checksum;
+  return sizeof(can_header) + len;
+}
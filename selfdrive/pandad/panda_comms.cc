@@ -1,10 +1,14 @@
 #include "selfdrive/pandad/panda.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstring>
 #include <stdexcept>
 #include <memory>
 
 #include "common/swaglog.h"
+#include "common/util.h"
 
 static libusb_context *init_usb_ctx() {
   libusb_context *context = nullptr;
@@ -66,6 +70,16 @@ PandaUsbHandle::PandaUsbHandle(std::string serial) : PandaCommsHandle(serial) {
   err = libusb_claim_interface(dev_handle, 0);
   if (err != 0) { goto fail; }
 
+  for (int i = 0; i < USB_RX_TRANSFERS; i++) {
+    libusb_transfer *transfer = libusb_alloc_transfer(0);
+    if (!transfer) { goto fail; }
+    auto &buf = rx_buffers.emplace_back(new uint8_t[USB_RX_TRANSFER_SIZE]);
+    libusb_fill_bulk_transfer(transfer, dev_handle, USB_CAN_RX_ENDPOINT, buf.get(), USB_RX_TRANSFER_SIZE, rx_transfer_callback, this, 0);
+    rx_transfers.push_back(transfer);
+  }
+
+  events_running = true;
+  event_thread = std::thread(&PandaUsbHandle::event_thread_loop, this);
   return;
 
 fail:
@@ -83,6 +97,19 @@ PandaUsbHandle::~PandaUsbHandle() {
 }
 
 void PandaUsbHandle::cleanup() {
+  stop_rx_transfers();
+  if (event_thread.joinable()) {
+    events_running = false;
+#if LIBUSB_API_VERSION >= 0x01000105
+    libusb_interrupt_event_handler(ctx);
+#endif
+    event_thread.join();
+  }
+  for (libusb_transfer *transfer : rx_transfers) {
+    libusb_free_transfer(transfer);
+  }
+  rx_transfers.clear();
+
   if (dev_handle) {
     libusb_release_interface(dev_handle, 0);
     libusb_close(dev_handle);
@@ -182,7 +209,7 @@ int PandaUsbHandle::bulk_write(unsigned char endpoint, unsigned char* data, int
     return 0;
   }
 
-  std::lock_guard lk(hw_lock);
+  std::lock_guard lk(bulk_out_lock);
   do {
     // Try sending can messages. If the receive buffer on the panda is full it will NAK
     // and libusb will try again. After 5ms, it will time out. We will drop the messages.
@@ -207,6 +234,10 @@ int PandaUsbHandle::bulk_read(unsigned char endpoint, unsigned char* data, int l
     return 0;
   }
 
+  if (endpoint == USB_CAN_RX_ENDPOINT && !rx_transfers.empty()) {
+    return read_rx_transfers(data, length);
+  }
+
   std::lock_guard lk(hw_lock);
 
   do {
@@ -225,3 +256,98 @@ int PandaUsbHandle::bulk_read(unsigned char endpoint, unsigned char* data, int l
 
   return transferred;
 }
+
+// Returns the data of the completed transfers and puts them back in flight.
+// Transfers that return data are resubmitted as soon as they are read, so under
+// load the panda is always polled. Empty ones wait for the next read instead
+// of spinning while the bus is idle.
+int PandaUsbHandle::read_rx_transfers(unsigned char *data, int length) {
+  std::lock_guard lk(rx_lock);
+
+  if (!rx_running) {
+    rx_running = true;
+    for (libusb_transfer *transfer : rx_transfers) {
+      submit_rx_transfer(transfer);
+    }
+  }
+
+  int transferred = 0;
+  while (!rx_completed.empty() && transferred < length) {
+    libusb_transfer *transfer = rx_completed.front();
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+      int n = std::min(transfer->actual_length - rx_offset, length - transferred);
+      memcpy(data + transferred, transfer->buffer + rx_offset, n);
+      rx_offset += n;
+      transferred += n;
+      if (rx_offset < transfer->actual_length) {
+        break;
+      }
+    } else if (transfer->status == LIBUSB_TRANSFER_OVERFLOW) {
+      comms_healthy = false;
+      LOGE_100("overflow got 0x%x", transfer->actual_length);
+    } else {
+      LOGE_100("usb rx transfer failed with status %d", transfer->status);
+    }
+
+    rx_completed.pop_front();
+    rx_offset = 0;
+    submit_rx_transfer(transfer);
+  }
+  return transferred;
+}
+
+// Cancels the transfers in flight and drops the completed ones, the next read
+// submits them again and only sees what the panda sends from then on.
+void PandaUsbHandle::flush_rx() {
+  stop_rx_transfers();
+}
+
+void PandaUsbHandle::submit_rx_transfer(libusb_transfer *transfer) {
+  if (!rx_running || !connected) {
+    return;
+  }
+
+  int err = libusb_submit_transfer(transfer);
+  if (err == 0) {
+    rx_in_flight++;
+  } else {
+    handle_usb_issue(err, __func__);
+  }
+}
+
+void PandaUsbHandle::stop_rx_transfers() {
+  std::unique_lock lk(rx_lock);
+  rx_running = false;
+  for (libusb_transfer *transfer : rx_transfers) {
+    libusb_cancel_transfer(transfer);  // fails for the ones not in flight
+  }
+  if (!rx_cv.wait_for(lk, std::chrono::seconds(1), [this]() { return rx_in_flight == 0; })) {
+    LOGE("timed out cancelling usb rx transfers");
+  }
+  rx_completed.clear();
+  rx_offset = 0;
+}
+
+void LIBUSB_CALL PandaUsbHandle::rx_transfer_callback(libusb_transfer *transfer) {
+  PandaUsbHandle *handle = (PandaUsbHandle *)transfer->user_data;
+  std::lock_guard lk(handle->rx_lock);
+  handle->rx_in_flight--;
+  if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+    LOGE("lost connection");
+    handle->connected = false;
+  } else if (handle->rx_running) {
+    handle->rx_completed.push_back(transfer);
+  }
+  handle->rx_cv.notify_all();
+}
+
+void PandaUsbHandle::event_thread_loop() {
+  util::set_thread_name("pandad_usb_events");
+
+  // control transfers and bulk writes stay synchronous, libusb lets
+  // them complete their own events while this thread handles the rest
+  while (events_running) {
+    struct timeval tv = {.tv_sec = 0, .tv_usec = 100000};
+    libusb_handle_events_timeout_completed(ctx, &tv, nullptr);
+  }
+}
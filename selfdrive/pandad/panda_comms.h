@@ -1,9 +1,14 @@
 #pragma once
 
+#include <array>
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #ifndef __APPLE__
@@ -14,7 +19,12 @@
 
 
 #define TIMEOUT 0
+#define USB_CAN_RX_ENDPOINT 0x81
+#define USB_RX_TRANSFERS 4
+#define USB_RX_TRANSFER_SIZE 0x4000
 #define SPI_BUF_SIZE 2048
+#define SPI_LATENCY_BUCKETS 8
+#define SPI_RETRY_BUCKETS 5
 
 
 // comms base class
@@ -34,6 +44,8 @@ public:
   virtual int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout=TIMEOUT) = 0;
   virtual int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT) = 0;
   virtual int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT) = 0;
+  // drops CAN data that was received but not read yet
+  virtual void flush_rx() {}
 };
 
 class PandaUsbHandle : public PandaCommsHandle {
@@ -44,6 +56,7 @@ public:
   int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout=TIMEOUT);
   int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
   int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  void flush_rx();
   void cleanup();
 
   static std::vector<std::string> list();
@@ -51,11 +64,81 @@ public:
 private:
   libusb_context *ctx = NULL;
   libusb_device_handle *dev_handle = NULL;
-  std::recursive_mutex hw_lock;
+  std::recursive_mutex hw_lock;  // control transfers
+  std::mutex bulk_out_lock;
   void handle_usb_issue(int err, const char func[]);
+
+  // CAN is received with several bulk IN transfers kept in flight, completed by the event thread
+  int read_rx_transfers(unsigned char *data, int length);
+  void submit_rx_transfer(libusb_transfer *transfer);
+  void stop_rx_transfers();
+  void event_thread_loop();
+  static void LIBUSB_CALL rx_transfer_callback(libusb_transfer *transfer);
+
+  std::vector<libusb_transfer *> rx_transfers;
+  std::vector<std::unique_ptr<uint8_t[]>> rx_buffers;
+  std::deque<libusb_transfer *> rx_completed;  // in completion order, i.e. stream order
+  int rx_offset = 0;  // bytes already read from the first completed transfer
+  int rx_in_flight = 0;
+  bool rx_running = false;
+  std::mutex rx_lock;
+  std::condition_variable rx_cv;
+
+  std::atomic<bool> events_running = false;
+  std::thread event_thread;
+};
+
+// In-process panda for load testing pandad without hardware, enabled with PANDA_SIM.
+// It answers the control requests pandad uses and generates CAN traffic on the
+// bulk IN endpoint, see sim.cc for the options.
+class PandaSimHandle : public PandaCommsHandle {
+public:
+  PandaSimHandle(std::string serial);
+  int control_write(uint8_t request, uint16_t param1, uint16_t param2, unsigned int timeout=TIMEOUT);
+  int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout=TIMEOUT);
+  int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  void cleanup() {}
+
+  static std::vector<std::string> list();
+
+private:
+  void generate_frames();
+  void queue_frame(uint32_t addr, uint8_t bus, bool returned, const uint8_t *dat, uint8_t len, bool corrupt);
+  void log_stats();
+
+  std::mutex lock;
+  std::vector<uint8_t> rx_queue;
+  size_t rx_queue_pos = 0;
+
+  // config
+  int buses;
+  double rate;
+  double checksum_err_prob;
+  bool ignition;
+  std::vector<uint8_t> dat_lens;
+
+  // state set by pandad
+  uint16_t safety_model = 0;
+  uint16_t safety_param = 0;
+  uint16_t alternative_experience = 0;
+  bool power_save = true;
+  bool loopback = false;
+  uint16_t fan_power = 0;
+
+  double start_time, last_gen_time, last_stats_time;
+  double frames_due = 0;
+  uint32_t seq = 0;
+  uint64_t generated = 0, dropped = 0, corrupted = 0, sent = 0;
+  std::vector<uint32_t> addresses;
 };
 
 #ifndef __APPLE__
+enum SpiError {
+  NACK = -2,
+  ACK_TIMEOUT = -3,
+};
+
 struct __attribute__((packed)) spi_header {
   uint8_t sync;
   uint8_t endpoint;
@@ -75,19 +158,34 @@ public:
 
   static std::vector<std::string> list();
 
-private:
-  int spi_fd = -1;
+protected:
+  // no device is opened, for tests that override lltransfer
+  PandaSpiHandle() : PandaCommsHandle("") {}
+
   uint8_t tx_buf[SPI_BUF_SIZE];
   uint8_t rx_buf[SPI_BUF_SIZE];
+
+  int send_and_wait_for_ack(unsigned int tx_len, uint8_t ack, uint8_t tx, unsigned int timeout, unsigned int length);
+  // timeout is counted from start_millis
+  int wait_for_ack(uint8_t ack, uint8_t tx, unsigned int timeout, unsigned int length, double start_millis);
+  virtual int lltransfer(spi_ioc_transfer *transfers, int count = 1);
+
+private:
+  int spi_fd = -1;
   inline static std::recursive_mutex hw_lock;
+  int lock_depth = 0;
+
+  // per transfer stats, logged periodically
+  std::array<uint32_t, SPI_LATENCY_BUCKETS> latency_hist = {};
+  std::array<uint32_t, SPI_RETRY_BUCKETS> retry_hist = {};
+  double last_stats_report = 0;
+  void add_stats(double latency_ms, int retries);
 
-  int wait_for_ack(uint8_t ack, uint8_t tx, unsigned int timeout, unsigned int length);
   int bulk_transfer(uint8_t endpoint, uint8_t *tx_data, uint16_t tx_len, uint8_t *rx_data, uint16_t rx_len, unsigned int timeout);
   int spi_transfer(uint8_t endpoint, uint8_t *tx_data, uint16_t tx_len, uint8_t *rx_data, uint16_t max_rx_len, unsigned int timeout);
   int spi_transfer_retry(uint8_t endpoint, uint8_t *tx_data, uint16_t tx_len, uint8_t *rx_data, uint16_t max_rx_len, unsigned int timeout);
-  int lltransfer(spi_ioc_transfer &t);
 
-  spi_header header;
+  spi_header header = {};
   uint32_t xfer_count = 0;
 };
 #endif
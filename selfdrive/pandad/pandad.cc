@@ -1,11 +1,17 @@
 #include "selfdrive/pandad/pandad.h"
 
+#include <pthread.h>
+
 #include <algorithm>
 #include <array>
 #include <bitset>
 #include <cassert>
 #include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <utility>
 
@@ -74,6 +80,121 @@ Panda *connect(std::string serial="", uint32_t index=0) {
   return panda.release();
 }
 
+// Runs a job for every panda concurrently: the first panda on the calling
+// thread, each other panda on a worker thread of its own. With a single
+// panda the job just runs inline.
+class PandaWorkers {
+public:
+  PandaWorkers(const std::vector<Panda *> &pandas, const char *name, std::function<void(size_t)> job) : job(job) {
+    for (size_t i = 1; i < pandas.size(); ++i) {
+      threads.emplace_back([=]() {
+        util::set_thread_name(util::string_format("%s_%zu", name, i).c_str());
+        workerThread(i);
+      });
+    }
+  }
+
+  ~PandaWorkers() {
+    {
+      std::lock_guard lk(lock);
+      exit = true;
+    }
+    cv.notify_all();
+    for (auto &t : threads) t.join();
+  }
+
+  // returns once the job finished for all pandas
+  void run() {
+    if (!threads.empty()) {
+      std::lock_guard lk(lock);
+      ++generation;
+      pending = threads.size();
+    }
+    cv.notify_all();
+
+    job(0);
+
+    if (!threads.empty()) {
+      std::unique_lock lk(lock);
+      done_cv.wait(lk, [this]() { return pending == 0; });
+    }
+  }
+
+private:
+  void workerThread(size_t idx) {
+    uint64_t last_generation = 0;
+    while (true) {
+      {
+        std::unique_lock lk(lock);
+        cv.wait(lk, [&]() { return exit || generation != last_generation; });
+        if (exit) break;
+        last_generation = generation;
+      }
+
+      job(idx);
+
+      std::lock_guard lk(lock);
+      if (--pending == 0) {
+        done_cv.notify_one();
+      }
+    }
+  }
+
+  std::function<void(size_t)> job;
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable cv, done_cv;
+  uint64_t generation = 0;
+  size_t pending = 0;
+  bool exit = false;
+};
+
+// value at the p-th percentile of the sorted latencies, in ms
+float latency_percentile(const std::vector<float> &sorted, float p) {
+  if (sorted.empty()) return 0;
+  return sorted[std::min<size_t>(sorted.size() * p, sorted.size() - 1)];
+}
+
+void publish_send_stats(PubMaster &pm, std::vector<CanSendQueue> &queues, double seconds) {
+  static std::vector<float> latency_ms;
+  latency_ms.clear();
+
+  MessageBuilder msg;
+  auto ss = msg.initEvent().initPandadSendStats();
+  CanSendQueue::Stats total;
+  uint32_t depth = 0;
+  for (auto &q : queues) {
+    total.queued += q.stats.queued;
+    total.sent += q.stats.sent;
+    total.coalesced += q.stats.coalesced;
+    total.expired += q.stats.expired;
+    total.dropped += q.stats.dropped;
+    total.backed_up += q.stats.backed_up;
+    total.max_depth = std::max(total.max_depth, q.stats.max_depth);
+    depth += q.depth();
+    latency_ms.insert(latency_ms.end(), q.stats.latency_ms.begin(), q.stats.latency_ms.end());
+
+    q.stats.queued = q.stats.sent = q.stats.coalesced = q.stats.expired = q.stats.dropped = 0;
+    q.stats.backed_up = q.stats.max_depth = 0;
+    q.stats.latency_ms.clear();
+  }
+  std::sort(latency_ms.begin(), latency_ms.end());
+
+  ss.setIntervalSeconds(seconds);
+  ss.setFramesQueued(total.queued);
+  ss.setFramesSent(total.sent);
+  ss.setFramesCoalesced(total.coalesced);
+  ss.setFramesExpired(total.expired);
+  ss.setFramesDropped(total.dropped);
+  ss.setWritesBackedUp(total.backed_up);
+  ss.setQueueDepth(depth);
+  ss.setMaxQueueDepth(total.max_depth);
+  ss.setSendLatencyP50Ms(latency_percentile(latency_ms, 0.5));
+  ss.setSendLatencyP99Ms(latency_percentile(latency_ms, 0.99));
+  ss.setSendLatencyMaxMs(latency_percentile(latency_ms, 1.0));
+  pm.send("pandadSendStats", msg);
+}
+
 void can_send_thread(std::vector<Panda *> pandas, bool fake_send) {
   util::set_thread_name("pandad_can_send");
 
@@ -81,53 +202,143 @@ void can_send_thread(std::vector<Panda *> pandas, bool fake_send) {
   std::unique_ptr<Context> context(Context::create());
   std::unique_ptr<SubSocket> subscriber(SubSocket::create(context.get(), "sendcan"));
   assert(subscriber != NULL);
-  subscriber->setTimeout(100);
+  PubMaster pm({"pandadSendStats"});
+
+  std::vector<CanSendQueue> queues;
+  for (auto panda : pandas) {
+    queues.emplace_back(panda);
+  }
+
+  // the same sendcan frames go to all pandas at once, each queue picks its own buses
+  std::vector<can_frame> frames;
+  uint64_t frames_mono_time = 0;
+  bool backed_up = false;
+  std::unique_ptr<bool[]> queue_pending(new bool[pandas.size()]());
+  PandaWorkers workers(pandas, "pandad_send", [&](size_t i) {
+    if (!frames.empty()) {
+      queues[i].push(frames, frames_mono_time);
+    }
+    queues[i].send();
+    queue_pending[i] = queues[i].pending();
+  });
 
-  // run as fast as messages come in
+  double last_stats_ms = millis_since_boot();
   while (!do_exit && check_all_connected(pandas)) {
+    // retry soon while a panda is backed up, otherwise run as fast as messages come in
+    subscriber->setTimeout(backed_up ? 1 : 100);
     std::unique_ptr<Message> msg(subscriber->receive());
-    if (!msg) {
-      if (errno == EINTR) {
-        do_exit = true;
-      }
+    if (!msg && errno == EINTR) {
+      do_exit = true;
       continue;
     }
 
-    capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg.get()));
-    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
-
-    // Don't send if older than 1 second
-    if ((nanos_since_boot() - event.getLogMonoTime() < 1e9) && !fake_send) {
-      for (const auto& panda : pandas) {
-        LOGT("sending sendcan to panda: %s", (panda->hw_serial()).c_str());
-        panda->can_send(event.getSendcan());
-        LOGT("sendcan sent to panda: %s", (panda->hw_serial()).c_str());
+    frames.clear();
+    if (msg) {
+      // messages are usually word aligned already, only copy the ones that aren't
+      const bool aligned = ((uintptr_t)msg->getData() % sizeof(capnp::word) == 0) && (msg->getSize() % sizeof(capnp::word) == 0);
+      capnp::FlatArrayMessageReader cmsg(aligned ? kj::arrayPtr((const capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word))
+                                                 : aligned_buf.align(msg.get()));
+      cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+
+      // Don't send if older than 1 second
+      frames_mono_time = event.getLogMonoTime();
+      if ((nanos_since_boot() - frames_mono_time < 1e9) && !fake_send) {
+        for (auto cmsg : event.getSendcan()) {
+          auto dat = cmsg.getDat();
+          assert(dat.size() <= CAN_FRAME_DATA_SIZE_MAX);
+          auto &f = frames.emplace_back();
+          f.address = cmsg.getAddress();
+          f.src = cmsg.getSrc();
+          f.size = dat.size();
+          memcpy(f.dat, dat.begin(), dat.size());
+        }
+      } else {
+        LOGE("sendcan too old to send: %" PRIu64 ", %" PRIu64, nanos_since_boot(), frames_mono_time);
       }
-    } else {
-      LOGE("sendcan too old to send: %" PRIu64 ", %" PRIu64, nanos_since_boot(), event.getLogMonoTime());
+    }
+
+    if (!frames.empty() || backed_up) {
+      workers.run();
+      backed_up = std::any_of(&queue_pending[0], &queue_pending[pandas.size()], [](bool p) { return p; });
+    }
+
+    const double now_ms = millis_since_boot();
+    if (now_ms - last_stats_ms >= 1000) {
+      publish_send_stats(pm, queues, (now_ms - last_stats_ms) / 1000.0);
+      last_stats_ms = now_ms;
     }
   }
 }
 
-void can_recv(std::vector<Panda *> &pandas, PubMaster *pm) {
-  static std::vector<can_frame> raw_can_data;
-  {
-    bool comms_healthy = true;
-    raw_can_data.clear();
-    for (const auto& panda : pandas) {
-      comms_healthy &= panda->can_receive(raw_can_data);
+void can_publish(const std::vector<std::vector<can_frame>> &panda_frames, bool comms_healthy, PubMaster *pm) {
+  // Message arena and output buffer are reused every cycle, so a steady
+  // stream of CAN messages is published without heap allocations.
+  static std::vector<capnp::word> arena;
+  static std::vector<capnp::word> out;
+
+  // the whole message fits in the first segment: event and list headers, then
+  // two words per CanData struct plus its word aligned payload
+  size_t arena_words = 64, frame_cnt = 0;
+  for (const auto &frames : panda_frames) {
+    frame_cnt += frames.size();
+    for (const auto &frame : frames) {
+      arena_words += 2 + (frame.size + sizeof(capnp::word) - 1) / sizeof(capnp::word);
     }
+  }
+  if (arena.size() < arena_words) {
+    arena.resize(arena_words * 2);
+  }
 
-    MessageBuilder msg;
-    auto evt = msg.initEvent();
+  {
+    // the builder zeroes the used part of the arena again when it goes out of scope
+    capnp::MallocMessageBuilder msg(kj::arrayPtr(arena.data(), arena.size()));
+    auto evt = msg.initRoot<cereal::Event>();
+    evt.setLogMonoTime(nanos_since_boot());
     evt.setValid(comms_healthy);
-    auto canData = evt.initCan(raw_can_data.size());
-    for (size_t i = 0; i < raw_can_data.size(); ++i) {
-      canData[i].setAddress(raw_can_data[i].address);
-      canData[i].setDat(kj::arrayPtr((uint8_t*)raw_can_data[i].dat.data(), raw_can_data[i].dat.size()));
-      canData[i].setSrc(raw_can_data[i].src);
+    // frames are merged in panda order, each panda's in the order received
+    auto canData = evt.initCan(frame_cnt);
+    size_t i = 0;
+    for (const auto &frames : panda_frames) {
+      for (const auto &frame : frames) {
+        canData[i].setAddress(frame.address);
+        canData[i].setDat(kj::arrayPtr(frame.dat, frame.size));
+        canData[i].setSrc(frame.src);
+        ++i;
+      }
+    }
+
+    const size_t msg_words = capnp::computeSerializedSizeInWords(msg);
+    if (out.size() < msg_words) {
+      out.resize(msg_words * 2);
     }
-    pm->send("can", msg);
+    kj::ArrayOutputStream output_stream(kj::arrayPtr(out.data(), msg_words).asBytes());
+    capnp::writeMessage(output_stream, msg);
+    pm->send("can", (capnp::byte *)out.data(), msg_words * sizeof(capnp::word));
+  }
+}
+
+void can_recv_thread(std::vector<Panda *> pandas) {
+  util::set_thread_name("pandad_can_recv");
+
+  // keeps the realtime priority of the process, nothing else runs in this loop
+  PubMaster pm({"can"});
+  RateKeeper rk("pandad_can_recv", 100);
+
+  // all pandas are read at once, into frame buffers sized for a full receive
+  std::vector<std::vector<can_frame>> panda_frames(pandas.size());
+  std::unique_ptr<bool[]> healthy(new bool[pandas.size()]);
+  for (auto &frames : panda_frames) {
+    frames.reserve(Panda::MAX_RECV_FRAMES);
+  }
+  PandaWorkers workers(pandas, "pandad_recv", [&](size_t i) {
+    panda_frames[i].clear();
+    healthy[i] = pandas[i]->can_receive(panda_frames[i]);
+  });
+
+  while (!do_exit && check_all_connected(pandas)) {
+    workers.run();
+    can_publish(panda_frames, std::all_of(&healthy[0], &healthy[pandas.size()], [](bool h) { return h; }), &pm);
+    rk.keepTime();
   }
 }
 
@@ -407,42 +618,60 @@ void process_peripheral_state(Panda *panda, PubMaster *pm, bool no_fan_control)
   }
 }
 
+// Peripheral state, fan and IR control do slow control transfers and are not
+// latency critical, they run at normal priority so they never delay CAN or the heartbeat.
+void peripheral_thread(Panda *panda, bool no_fan_control) {
+  util::set_thread_name("pandad_peripheral");
+
+  if (!Hardware::PC()) {
+    struct sched_param sa = {};
+    int err = pthread_setschedparam(pthread_self(), SCHED_OTHER, &sa);
+    if (err != 0) {
+      LOGW("failed to lower peripheral thread priority: %d", err);
+    }
+  }
+
+  RateKeeper rk("pandad_peripheral", 20);
+  PubMaster pm({"peripheralState"});
+  while (!do_exit && panda->connected()) {
+    // Process peripheral state at 20 Hz
+    process_peripheral_state(panda, &pm, no_fan_control);
+
+    // Send out peripheralState at 2Hz
+    if (rk.frame() % 10 == 0) {
+      send_peripheral_state(panda, &pm);
+    }
+
+    rk.keepTime();
+  }
+}
+
 void pandad_run(std::vector<Panda *> &pandas) {
   const bool no_fan_control = getenv("NO_FAN_CONTROL") != nullptr;
   const bool spoofing_started = getenv("STARTED") != nullptr;
   const bool fake_send = getenv("FAKESEND") != nullptr;
 
-  // Start the CAN send thread
+  // Start the CAN send and receive threads, they inherit the realtime priority
   std::thread send_thread(can_send_thread, pandas, fake_send);
+  std::thread recv_thread(can_recv_thread, pandas);
+  std::thread peripheral(peripheral_thread, pandas[0], no_fan_control);
 
-  RateKeeper rk("pandad", 100);
-  PubMaster pm({"can", "pandaStates", "peripheralState"});
+  // The main thread keeps the realtime priority, the heartbeat and safety
+  // configuration are what keep the pandas in controls.
+  RateKeeper rk("pandad", 10);
+  PubMaster pm({"pandaStates"});
   PandaSafety panda_safety(pandas);
-  Panda *peripheral_panda = pandas[0];
 
-  // Main loop: receive CAN data and process states
+  // Main loop: process panda state at 10 Hz
   while (!do_exit && check_all_connected(pandas)) {
-    can_recv(pandas, &pm);
-
-    // Process peripheral state at 20 Hz
-    if (rk.frame() % 5 == 0) {
-      process_peripheral_state(peripheral_panda, &pm, no_fan_control);
-    }
-
-    // Process panda state at 10 Hz
-    if (rk.frame() % 10 == 0) {
-      process_panda_state(pandas, &pm, spoofing_started);
-      panda_safety.configureSafetyMode();
-    }
-
-    // Send out peripheralState at 2Hz
-    if (rk.frame() % 50 == 0) {
-      send_peripheral_state(peripheral_panda, &pm);
-    }
+    process_panda_state(pandas, &pm, spoofing_started);
+    panda_safety.configureSafetyMode();
 
     rk.keepTime();
   }
 
+  peripheral.join();
+  recv_thread.join();
   send_thread.join();
 }
 
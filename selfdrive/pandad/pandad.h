@@ -1,6 +1,8 @@
 #pragma once
 
+#include <deque>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "common/params.h"
@@ -24,3 +26,51 @@ private:
   std::vector<Panda *> pandas_;
   Params params_;
 };
+
+// sendcan frames waiting to be written to one panda. While the panda is backed up,
+// a newer frame for the same bus and address supersedes the pending one, which is
+// skipped instead of sent, so the latency of control messages stays bounded.
+// Frames go out in the order they were pushed.
+class CanSendQueue {
+public:
+  CanSendQueue(Panda *panda) : panda_(panda) {}
+  void push(const std::vector<can_frame> &frames, uint64_t mono_time);
+  // writes as much as the panda accepts, returns false while it's backed up
+  bool send();
+  bool pending() const { return !pending_.empty() || !unsent_.empty(); }
+  size_t depth() const { return live_; }
+
+  // counters since the last reset by the stats publisher
+  struct Stats {
+    uint32_t queued = 0;
+    uint32_t sent = 0;
+    uint32_t coalesced = 0;
+    uint32_t expired = 0;
+    uint32_t dropped = 0;
+    uint32_t backed_up = 0;
+    uint32_t max_depth = 0;
+    std::vector<float> latency_ms;  // sendcan logMonoTime to write, per frame sent
+  } stats;
+
+private:
+  struct PendingFrame {
+    uint64_t mono_time;
+    uint64_t batch;
+    bool superseded;
+    can_frame frame;
+  };
+
+  Panda *panda_;
+  std::deque<PendingFrame> pending_;
+  size_t live_ = 0;  // pending frames that are not superseded
+  uint64_t pending_base_ = 0;  // sequence number of pending_.front()
+  uint64_t batch_ = 0;
+  // bus and address -> sequence number of its latest frame, entries are kept
+  // once added so the steady state doesn't allocate
+  std::unordered_map<uint64_t, uint64_t> latest_;
+  std::vector<uint8_t> unsent_;  // tail of a write the panda only partly accepted, goes out first
+  std::deque<uint8_t> unsent_frames_;  // bytes left of each frame in unsent_, or being written
+
+  void count_written(int written);
+  void drop_unsent(int error);
+};
@@ -1,56 +1,126 @@
 # distutils: language = c++
 # cython: language_level=3
-from cython.operator cimport dereference as deref, preincrement as preinc
 from libcpp.vector cimport vector
 from libcpp.string cimport string
 from libcpp cimport bool
 from libc.stdint cimport uint8_t, uint32_t, uint64_t
+from libc.string cimport memcpy
+
+import numpy as np
 
 cdef extern from "panda.h":
   cdef struct can_frame:
     long address
-    string dat
     long src
+    uint8_t size
+    uint8_t dat[64]
 
-cdef extern from "opendbc/can/common.h":
-  cdef struct CanFrame:
-    long src
-    uint32_t address
+cdef extern from "can_list_to_can_capnp.cc":
+  cdef cppclass CanColumns:
+    vector[uint64_t] nanos
+    vector[uint32_t] frame_offsets
+    vector[uint32_t] addresses
+    vector[uint8_t] buses
+    vector[uint32_t] dat_offsets
     vector[uint8_t] dat
+    void clear()
 
-  cdef struct CanData:
-    uint64_t nanos
-    vector[CanFrame] frames
-
-cdef extern from "can_list_to_can_capnp.cc":
   void can_list_to_can_capnp_cpp(const vector[can_frame] &can_list, string &out, bool sendcan, bool valid)
-  void can_capnp_to_can_list_cpp(const vector[string] &strings, vector[CanData] &can_data, bool sendcan)
+  void can_capnp_to_can_columns_cpp(const char *data, size_t size, CanColumns &columns, bool sendcan) except +
 
 def can_list_to_can_capnp(can_msgs, msgtype='can', valid=True):
   cdef can_frame *f
   cdef vector[can_frame] can_list
+  cdef bytes dat
 
   can_list.reserve(len(can_msgs))
   for can_msg in can_msgs:
+    dat = bytes(can_msg[1])
+    if len(dat) > sizeof(f.dat):
+      raise ValueError(f"CAN data too long: {len(dat)} bytes")
     f = &(can_list.emplace_back())
     f.address = can_msg[0]
-    f.dat = can_msg[1]
+    f.size = len(dat)
+    memcpy(f.dat, <const char *>dat, f.size)
     f.src = can_msg[2]
 
   cdef string out
   can_list_to_can_capnp_cpp(can_list, out, msgtype == 'sendcan', valid)
   return out
 
+cdef void parse_columns(strings, CanColumns &columns, bool sendcan) except *:
+  cdef const unsigned char[::1] buf
+  columns.clear()
+  for s in strings:
+    buf = s
+    can_capnp_to_can_columns_cpp(<const char *>&buf[0] if len(buf) else NULL, len(buf), columns, sendcan)
+
+cdef CanColumns list_columns
+
 def can_capnp_to_list(strings, msgtype='can'):
-  cdef vector[CanData] data
-  can_capnp_to_can_list_cpp(strings, data, msgtype == 'sendcan')
+  parse_columns(strings, list_columns, msgtype == 'sendcan')
 
   result = []
-  cdef CanData *d
-  cdef vector[CanData].iterator it = data.begin()
-  while it != data.end():
-    d = &deref(it)
-    frames = [(f.address, (<char *>&f.dat[0])[:f.dat.size()], f.src) for f in d.frames]
-    result.append((d.nanos, frames))
-    preinc(it)
+  cdef size_t m, i
+  cdef const char *dat = <const char *>list_columns.dat.data()
+  for m in range(list_columns.nanos.size()):
+    frames = [(list_columns.addresses[i], dat[list_columns.dat_offsets[i]:list_columns.dat_offsets[i + 1]], list_columns.buses[i])
+              for i in range(list_columns.frame_offsets[m], list_columns.frame_offsets[m + 1])]
+    result.append((list_columns.nanos[m], frames))
   return result
+
+cdef class ColumnBuffer:
+  """Exports one column of a parser's arena as a read-only buffer, and keeps the parser alive."""
+  cdef object owner
+  cdef void *data
+  cdef Py_ssize_t shape[1]
+  cdef Py_ssize_t strides[1]
+
+  def __getbuffer__(self, Py_buffer *buffer, int flags):
+    buffer.buf = self.data
+    buffer.obj = self
+    buffer.len = self.shape[0]
+    buffer.readonly = 1
+    buffer.itemsize = 1
+    buffer.format = 'B'
+    buffer.ndim = 1
+    buffer.shape = self.shape
+    buffer.strides = self.strides
+    buffer.suboffsets = NULL
+    buffer.internal = NULL
+
+  def __releasebuffer__(self, Py_buffer *buffer):
+    pass
+
+cdef column_view(owner, void *data, size_t size, dtype):
+  # numpy view of size bytes of a column, no copy
+  if size == 0:
+    return np.empty(0, dtype=dtype)
+  cdef ColumnBuffer buf = ColumnBuffer.__new__(ColumnBuffer)
+  buf.owner = owner
+  buf.data = data
+  buf.shape[0] = size
+  buf.strides[0] = 1
+  return np.asarray(buf).view(dtype)
+
+cdef class CanColumnsParser:
+  """Parses can or sendcan messages into numpy columns, with one arena reused across calls.
+
+  parse() returns (nanos, frame_offsets, addresses, buses, dat_offsets, dat): the frames of
+  message m are frame_offsets[m]:frame_offsets[m + 1], the payload of frame i is
+  dat[dat_offsets[i]:dat_offsets[i + 1]].
+
+  The arrays are read-only views into the arena, not copies, and keep the parser alive.
+  They are only valid until the next parse(), copy them to keep them longer.
+  """
+  cdef CanColumns columns
+
+  def parse(self, strings, msgtype='can'):
+    parse_columns(strings, self.columns, msgtype == 'sendcan')
+    cdef CanColumns *c = &self.columns
+    return (column_view(self, c.nanos.data(), c.nanos.size() * sizeof(uint64_t), np.uint64),
+            column_view(self, c.frame_offsets.data(), c.frame_offsets.size() * sizeof(uint32_t), np.uint32),
+            column_view(self, c.addresses.data(), c.addresses.size() * sizeof(uint32_t), np.uint32),
+            column_view(self, c.buses.data(), c.buses.size(), np.uint8),
+            column_view(self, c.dat_offsets.data(), c.dat_offsets.size() * sizeof(uint32_t), np.uint32),
+            column_view(self, c.dat.data(), c.dat.size(), np.uint8))
@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include "cereal/gen/cpp/log.capnp.h"
+#include "common/swaglog.h"
+#include "common/timing.h"
+#include "common/util.h"
+#include "selfdrive/pandad/panda.h"
+
+// Options, all from the environment:
+//   PANDA_SIM=<n>                 simulate n pandas
+//   PANDA_SIM_BUSES=<n>           buses with traffic per panda, default 3
+//   PANDA_SIM_RATE=<hz>           frames per second per panda, default 3000
+//   PANDA_SIM_DAT_LENS=<l,l,..>   payload lengths to pick from, default 8. Longer than 8 makes it a CAN FD panda
+//   PANDA_SIM_CHECKSUM_ERR=<p>    probability of a frame with a bad checksum, default 0
+//   PANDA_SIM_IGNITION=<0|1>      ignition line, default 1
+//
+// Frames with 8 or more bytes carry a sequence number and the time they were
+// generated (little endian uint32 each, microseconds since boot), so drops and
+// latency can be measured from the can stream.
+//
+// The firmware signature is not simulated, run pandad with BOARDD_SKIP_FW_CHECK=1.
+
+const size_t SIM_RX_BUFFER_SIZE = 0x10000;  // frames are dropped when pandad can't keep up
+const double SIM_STATS_INTERVAL = 10.0;  // seconds
+const int SIM_ADDRESSES_PER_BUS = 64;
+
+static std::mt19937 &sim_rng() {
+  static thread_local std::mt19937 rng(std::random_device{}());
+  return rng;
+}
+
+std::vector<std::string> PandaSimHandle::list() {
+  std::vector<std::string> serials;
+  for (int i = 0; i < util::getenv("PANDA_SIM", 0); i++) {
+    serials.push_back("sim" + std::to_string(i));
+  }
+  return serials;
+}
+
+PandaSimHandle::PandaSimHandle(std::string serial) : PandaCommsHandle(serial) {
+  auto serials = list();
+  if (serials.empty() || (!serial.empty() && std::find(serials.begin(), serials.end(), serial) == serials.end())) {
+    throw std::runtime_error("Error connecting to panda");
+  }
+  hw_serial = serial.empty() ? serials[0] : serial;
+
+  buses = std::clamp(util::getenv("PANDA_SIM_BUSES", 3), 1, PANDA_BUS_OFFSET);
+  rate = util::getenv("PANDA_SIM_RATE", 3000.0f);
+  checksum_err_prob = util::getenv("PANDA_SIM_CHECKSUM_ERR", 0.0f);
+  ignition = util::getenv("PANDA_SIM_IGNITION", 1);
+
+  std::stringstream lens(util::getenv("PANDA_SIM_DAT_LENS", "8"));
+  for (std::string len; std::getline(lens, len, ',');) {
+    int l = std::stoi(len);
+    if (l < 0 || l > (int)CAN_FRAME_DATA_SIZE_MAX || dlc_to_len[LEN_TO_DLC[l]] != l) {
+      throw std::runtime_error("invalid PANDA_SIM_DAT_LENS length " + len);
+    }
+    dat_lens.push_back(l);
+  }
+
+  for (int bus = 0; bus < buses; bus++) {
+    for (int i = 0; i < SIM_ADDRESSES_PER_BUS; i++) {
+      addresses.push_back(0x100 + bus * 0x100 + i * 3);
+    }
+  }
+
+  rx_queue.reserve(2 * SIM_RX_BUFFER_SIZE);
+  start_time = last_gen_time = last_stats_time = millis_since_boot() / 1000.0;
+  LOGW("simulating panda %s: %d buses, %.0f frames/s", hw_serial.c_str(), buses, rate);
+}
+
+int PandaSimHandle::control_write(uint8_t request, uint16_t param1, uint16_t param2, unsigned int timeout) {
+  std::lock_guard lk(lock);
+  switch (request) {
+    case 0xdc:  // safety model
+      safety_model = param1;
+      safety_param = param2;
+      break;
+    case 0xdf:
+      alternative_experience = param1;
+      break;
+    case 0xe7:
+      power_save = param1;
+      break;
+    case 0xe5:
+      loopback = param1;
+      break;
+    case 0xb1:
+      fan_power = param1;
+      break;
+    case 0xc0:  // reset communications
+      rx_queue.clear();
+      rx_queue_pos = 0;
+      break;
+    default:
+      break;
+  }
+  return 0;
+}
+
+int PandaSimHandle::control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout) {
+  std::lock_guard lk(lock);
+  const bool canfd = std::any_of(dat_lens.begin(), dat_lens.end(), [](uint8_t l) { return l > 8; });
+
+  switch (request) {
+    case 0xc1: {  // hw type
+      data[0] = (uint8_t)(canfd ? cereal::PandaState::PandaType::RED_PANDA : cereal::PandaState::PandaType::DOS);
+      return 1;
+    }
+    case 0xd2: {  // health
+      health_t health = {};
+      health.uptime_pkt = millis_since_boot() / 1000.0 - start_time;
+      health.voltage_pkt = 12000;
+      health.ignition_line_pkt = ignition;
+      health.safety_mode_pkt = safety_model;
+      health.safety_param_pkt = safety_param;
+      health.alternative_experience_pkt = alternative_experience;
+      health.power_save_enabled_pkt = power_save;
+      health.car_harness_status_pkt = 1;
+      health.fan_power = fan_power;
+      memcpy(data, &health, std::min<size_t>(length, sizeof(health)));
+      return std::min<size_t>(length, sizeof(health));
+    }
+    case 0xc2: {  // CAN health
+      can_health_t can_health = {};
+      can_health.can_speed = 500;
+      can_health.can_data_speed = canfd ? 2000 : 500;
+      can_health.canfd_enabled = canfd;
+      can_health.total_rx_cnt = generated / buses;
+      can_health.total_tx_cnt = sent / buses;
+      memcpy(data, &can_health, std::min<size_t>(length, sizeof(can_health)));
+      return std::min<size_t>(length, sizeof(can_health));
+    }
+    case 0xd0: {  // serial
+      int len = std::min<size_t>(length, hw_serial.size());
+      memcpy(data, hw_serial.data(), len);
+      return len;
+    }
+    case 0xb2: {  // fan rpm
+      uint16_t rpm = fan_power * 65;
+      memcpy(data, &rpm, std::min<size_t>(length, sizeof(rpm)));
+      return std::min<size_t>(length, sizeof(rpm));
+    }
+    default:
+      memset(data, 0, length);
+      return length;
+  }
+}
+
+int PandaSimHandle::bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  std::lock_guard lk(lock);
+  for (int pos = 0; pos + (int)sizeof(can_header) <= length;) {
+    can_header header;
+    memcpy(&header, &data[pos], sizeof(header));
+    const uint8_t len = dlc_to_len[header.data_len_code];
+    if (pos + sizeof(can_header) + len > length) break;
+
+    sent++;
+    if (loopback) {
+      queue_frame(header.addr, header.bus, true, &data[pos + sizeof(can_header)], len, false);
+    }
+    pos += sizeof(can_header) + len;
+  }
+  return length;
+}
+
+int PandaSimHandle::bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  if (endpoint != 0x81) {
+    return 0;
+  }
+
+  std::lock_guard lk(lock);
+  generate_frames();
+
+  // like the panda, the stream is cut wherever the read ends, not at frame boundaries
+  int n = std::min<size_t>(length, rx_queue.size() - rx_queue_pos);
+  memcpy(data, &rx_queue[rx_queue_pos], n);
+  rx_queue_pos += n;
+  if (rx_queue_pos == rx_queue.size()) {
+    rx_queue.clear();
+    rx_queue_pos = 0;
+  }
+
+  log_stats();
+  return n;
+}
+
+void PandaSimHandle::generate_frames() {
+  const double now = millis_since_boot() / 1000.0;
+  frames_due += (now - last_gen_time) * rate;
+  last_gen_time = now;
+
+  // keep generating at the configured rate, but don't catch up on long stalls
+  frames_due = std::min(frames_due, rate);
+
+  auto &rng = sim_rng();
+  std::uniform_real_distribution<double> prob(0.0, 1.0);
+
+  for (; frames_due >= 1.0; frames_due -= 1.0) {
+    // frames arrive evenly spread over the time since the last read
+    const uint32_t time_us = (uint64_t)((now - (frames_due - 1.0) / rate) * 1e6);
+    const uint32_t addr = addresses[rng() % addresses.size()];
+    const uint8_t len = dat_lens[rng() % dat_lens.size()];
+
+    uint8_t dat[CAN_FRAME_DATA_SIZE_MAX];
+    for (int i = 0; i < len; i++) {
+      dat[i] = rng();
+    }
+    if (len >= 8) {
+      memcpy(&dat[0], &seq, sizeof(seq));
+      memcpy(&dat[4], &time_us, sizeof(time_us));
+    }
+    seq++;
+
+    queue_frame(addr, ((addr >> 8) - 1) % buses, false, dat, len, prob(rng) < checksum_err_prob);
+    generated++;
+  }
+}
+
+void PandaSimHandle::queue_frame(uint32_t addr, uint8_t bus, bool returned, const uint8_t *dat, uint8_t len, bool corrupt) {
+  if (rx_queue.size() - rx_queue_pos + sizeof(can_header) + len > SIM_RX_BUFFER_SIZE) {
+    dropped++;
+    return;
+  }
+
+  // compact before growing, so the queue never reallocates
+  if (rx_queue.size() + sizeof(can_header) + len > rx_queue.capacity()) {
+    rx_queue.erase(rx_queue.begin(), rx_queue.begin() + rx_queue_pos);
+    rx_queue_pos = 0;
+  }
+
+  const size_t pos = rx_queue.size();
+  rx_queue.resize(pos + sizeof(can_header) + len);
+  uint8_t *frame = &rx_queue[pos];
+  Panda::pack_can_frame(frame, addr, bus, LEN_TO_DLC[len], dat, len);
+
+  if (returned) {
+    // set the returned bit of can_header and keep the checksum valid
+    frame[1] |= 0x02;
+    frame[sizeof(can_header) - 1] ^= 0x02;
+  }
+  if (corrupt) {
+    frame[sizeof(can_header) - 1] ^= 0xff;
+    corrupted++;
+  }
+}
+
+void PandaSimHandle::log_stats() {
+  const double now = millis_since_boot() / 1000.0;
+  if (now - last_stats_time > SIM_STATS_INTERVAL) {
+    LOGW("panda sim %s: generated %" PRIu64 ", dropped %" PRIu64 ", bad checksum %" PRIu64 ", sent %" PRIu64,
+         hw_serial.c_str(), generated, dropped, corrupted, sent);
+    last_stats_time = now;
+  }
+}
@@ -3,6 +3,7 @@
 #include <sys/ioctl.h>
 #include <linux/spi/spidev.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstring>
@@ -23,29 +24,35 @@
 #define SPI_CHECKSUM_START 0xABU
 
 
-enum SpiError {
-  NACK = -2,
-  ACK_TIMEOUT = -3,
-};
-
 const unsigned int SPI_ACK_TIMEOUT = 500; // milliseconds
 const std::string SPI_DEVICE = "/dev/spidev0.0";
 
+// latency bucket upper bounds in microseconds, the last bucket is everything above
+const std::array<double, SPI_LATENCY_BUCKETS - 1> SPI_LATENCY_BOUNDS_US = {100, 200, 500, 1000, 2000, 5000, 10000};
+const double SPI_STATS_INTERVAL = 60000; // milliseconds
+
+// Nests: the flock is only taken by the outermost lock,
+// so a bulk transfer keeps the bus for all its chunks.
 class LockEx {
 public:
-  LockEx(int fd, std::recursive_mutex &m) : fd(fd), m(m) {
+  LockEx(int fd, std::recursive_mutex &m, int &depth) : fd(fd), m(m), depth(depth) {
     m.lock();
-    flock(fd, LOCK_EX);
+    if (depth++ == 0) {
+      flock(fd, LOCK_EX);
+    }
   }
 
   ~LockEx() {
-    flock(fd, LOCK_UN);
+    if (--depth == 0) {
+      flock(fd, LOCK_UN);
+    }
     m.unlock();
   }
 
 private:
   int fd;
   std::recursive_mutex &m;
+  int &depth;
 };
 
 #define SPILOG(fn, fmt, ...) do {  \
@@ -166,6 +173,8 @@ int PandaSpiHandle::bulk_transfer(uint8_t endpoint, uint8_t *tx_data, uint16_t t
 
   int ret = 0;
   uint16_t length = (tx_data != NULL) ? tx_len : rx_len;
+  // all chunks go out back to back, without other transfers in between
+  LockEx lock(spi_fd, hw_lock, lock_depth);
   for (int i = 0; i < (int)std::ceil((float)length / xfer_size); i++) {
     int d;
     if (tx_data != NULL) {
@@ -219,6 +228,7 @@ bool check_checksum(uint8_t *data, int data_len) {
 
 int PandaSpiHandle::spi_transfer_retry(uint8_t endpoint, uint8_t *tx_data, uint16_t tx_len, uint8_t *rx_data, uint16_t max_rx_len, unsigned int timeout) {
   int ret;
+  int tries = 0;
   int nack_count = 0;
   int timeout_count = 0;
   bool timed_out = false;
@@ -226,6 +236,7 @@ int PandaSpiHandle::spi_transfer_retry(uint8_t endpoint, uint8_t *tx_data, uint1
 
   do {
     ret = spi_transfer(endpoint, tx_data, tx_len, rx_data, max_rx_len, timeout);
+    tries++;
 
     if (ret < 0) {
       timed_out = (timeout != 0) && (timeout_count > 5);
@@ -250,11 +261,69 @@ int PandaSpiHandle::spi_transfer_retry(uint8_t endpoint, uint8_t *tx_data, uint1
     SPILOG(LOGE, "transfer failed, after %d tries, %.2fms", timeout_count, millis_since_boot() - start_time);
   }
 
+  add_stats(millis_since_boot() - start_time, tries - 1);
   return ret;
 }
 
-int PandaSpiHandle::wait_for_ack(uint8_t ack, uint8_t tx, unsigned int timeout, unsigned int length) {
-  double start_millis = millis_since_boot();
+void PandaSpiHandle::add_stats(double latency_ms, int retries) {
+  std::lock_guard lk(hw_lock);
+
+  const double latency_us = latency_ms * 1000.0;
+  int bucket = std::upper_bound(SPI_LATENCY_BOUNDS_US.begin(), SPI_LATENCY_BOUNDS_US.end(), latency_us) - SPI_LATENCY_BOUNDS_US.begin();
+  latency_hist[bucket]++;
+  retry_hist[std::min(retries, SPI_RETRY_BUCKETS - 1)]++;
+
+  const double now = millis_since_boot();
+  if (last_stats_report == 0) {
+    last_stats_report = now;
+  } else if (now - last_stats_report > SPI_STATS_INTERVAL) {
+    std::string latency_str, retry_str;
+    for (int i = 0; i < SPI_LATENCY_BUCKETS; i++) {
+      latency_str += util::string_format("%s%s%.0f: %u", i ? ", " : "", i < SPI_LATENCY_BUCKETS - 1 ? "<" : ">=",
+                                         SPI_LATENCY_BOUNDS_US[std::min(i, SPI_LATENCY_BUCKETS - 2)], latency_hist[i]);
+    }
+    for (int i = 0; i < SPI_RETRY_BUCKETS; i++) {
+      retry_str += util::string_format("%s%d%s: %u", i ? ", " : "", i, i < SPI_RETRY_BUCKETS - 1 ? "" : "+", retry_hist[i]);
+    }
+    LOGW("SPI transfers, latency us {%s}, retries {%s}", latency_str.c_str(), retry_str.c_str());
+
+    latency_hist = {};
+    retry_hist = {};
+    last_stats_report = now;
+  }
+}
+
+int PandaSpiHandle::send_and_wait_for_ack(unsigned int tx_len, uint8_t ack, uint8_t tx, unsigned int timeout, unsigned int length) {
+  const double start_millis = millis_since_boot();
+
+  // The send and the first (N)ACK poll go out in a single ioctl. cs_change
+  // releases chip select in between, so the panda sees the same two transfers.
+  uint8_t poll_tx[3];
+  assert(length <= sizeof(poll_tx));
+  memset(poll_tx, tx, length);
+
+  spi_ioc_transfer transfers[2] = {
+    {.tx_buf = (uint64_t)tx_buf, .len = tx_len, .cs_change = 1},
+    {.tx_buf = (uint64_t)poll_tx, .rx_buf = (uint64_t)rx_buf, .len = length},
+  };
+  int ret = lltransfer(transfers, 2);
+  if (ret < 0) {
+    SPILOG(LOGE, "SPI: failed to send, waiting for 0x%x", ack);
+    return ret;
+  }
+
+  if (rx_buf[0] == ack) {
+    return 0;
+  } else if (rx_buf[0] == SPI_NACK) {
+    SPILOG(LOGD, "SPI: got NACK, waiting for 0x%x", ack);
+    return SpiError::NACK;
+  }
+
+  // not ready yet, keep polling for what is left of the timeout
+  return wait_for_ack(ack, tx, timeout, length, start_millis);
+}
+
+int PandaSpiHandle::wait_for_ack(uint8_t ack, uint8_t tx, unsigned int timeout, unsigned int length, double start_millis) {
   if (timeout == 0) {
     timeout = SPI_ACK_TIMEOUT;
   }
@@ -268,7 +337,7 @@ int PandaSpiHandle::wait_for_ack(uint8_t ack, uint8_t tx, unsigned int timeout,
   memset(tx_buf, tx, length);
 
   while (true) {
-    int ret = lltransfer(transfer);
+    int ret = lltransfer(&transfer);
     if (ret < 0) {
       SPILOG(LOGE, "SPI: failed to send ACK request");
       return ret;
@@ -291,32 +360,39 @@ int PandaSpiHandle::wait_for_ack(uint8_t ack, uint8_t tx, unsigned int timeout,
   return 0;
 }
 
-int PandaSpiHandle::lltransfer(spi_ioc_transfer &t) {
+int PandaSpiHandle::lltransfer(spi_ioc_transfer *transfers, int count) {
   static const double err_prob = std::stod(util::getenv("SPI_ERR_PROB", "-1"));
+  assert(count == 1 || count == 2);
 
   if (err_prob > 0) {
-    if ((static_cast<double>(rand()) / RAND_MAX) < err_prob) {
-      printf("transfer len error\n");
-      t.len = rand() % SPI_BUF_SIZE;
-    }
-    if ((static_cast<double>(rand()) / RAND_MAX) < err_prob && t.tx_buf != (uint64_t)NULL) {
-      printf("corrupting TX\n");
-      for (int i = 0; i < t.len; i++) {
-        if ((static_cast<double>(rand()) / RAND_MAX) > 0.9) {
-          ((uint8_t*)t.tx_buf)[i] = (uint8_t)(rand() % 256);
+    for (int n = 0; n < count; n++) {
+      spi_ioc_transfer &t = transfers[n];
+      if ((static_cast<double>(rand()) / RAND_MAX) < err_prob) {
+        printf("transfer len error\n");
+        t.len = rand() % SPI_BUF_SIZE;
+      }
+      if ((static_cast<double>(rand()) / RAND_MAX) < err_prob && t.tx_buf != (uint64_t)NULL) {
+        printf("corrupting TX\n");
+        for (int i = 0; i < t.len; i++) {
+          if ((static_cast<double>(rand()) / RAND_MAX) > 0.9) {
+            ((uint8_t*)t.tx_buf)[i] = (uint8_t)(rand() % 256);
+          }
         }
       }
     }
   }
 
-  int ret = util::safe_ioctl(spi_fd, SPI_IOC_MESSAGE(1), &t);
+  int ret = util::safe_ioctl(spi_fd, count == 1 ? SPI_IOC_MESSAGE(1) : SPI_IOC_MESSAGE(2), transfers);
 
   if (err_prob > 0) {
-    if ((static_cast<double>(rand()) / RAND_MAX) < err_prob && t.rx_buf != (uint64_t)NULL) {
-      printf("corrupting RX\n");
-      for (int i = 0; i < t.len; i++) {
-        if ((static_cast<double>(rand()) / RAND_MAX) > 0.9) {
-          ((uint8_t*)t.rx_buf)[i] = (uint8_t)(rand() % 256);
+    for (int n = 0; n < count; n++) {
+      spi_ioc_transfer &t = transfers[n];
+      if ((static_cast<double>(rand()) / RAND_MAX) < err_prob && t.rx_buf != (uint64_t)NULL) {
+        printf("corrupting RX\n");
+        for (int i = 0; i < t.len; i++) {
+          if ((static_cast<double>(rand()) / RAND_MAX) > 0.9) {
+            ((uint8_t*)t.rx_buf)[i] = (uint8_t)(rand() % 256);
+          }
         }
       }
     }
@@ -328,7 +404,7 @@ int PandaSpiHandle::lltransfer(spi_ioc_transfer &t) {
 int PandaSpiHandle::spi_transfer(uint8_t endpoint, uint8_t *tx_data, uint16_t tx_len, uint8_t *rx_data, uint16_t max_rx_len, unsigned int timeout) {
   int ret;
   uint16_t rx_data_len;
-  LockEx lock(spi_fd, hw_lock);
+  LockEx lock(spi_fd, hw_lock, lock_depth);
 
   // needs to be less, since we need to have space for the checksum
   assert(tx_len < SPI_BUF_SIZE);
@@ -347,36 +423,20 @@ int PandaSpiHandle::spi_transfer(uint8_t endpoint, uint8_t *tx_data, uint16_t tx
     .rx_buf = (uint64_t)rx_buf
   };
 
-  // Send header
+  // Send header and wait for (N)ACK
   memcpy(tx_buf, &header, sizeof(header));
   add_checksum(tx_buf, sizeof(header));
-  transfer.len = sizeof(header) + 1;
-  ret = lltransfer(transfer);
+  ret = send_and_wait_for_ack(sizeof(header) + 1, SPI_HACK, 0x11, timeout, 1);
   if (ret < 0) {
-    SPILOG(LOGE, "SPI: failed to send header");
     goto fail;
   }
 
-  // Wait for (N)ACK
-  ret = wait_for_ack(SPI_HACK, 0x11, timeout, 1);
-  if (ret < 0) {
-    goto fail;
-  }
-
-  // Send data
+  // Send data and wait for (N)ACK
   if (tx_data != NULL) {
     memcpy(tx_buf, tx_data, tx_len);
   }
   add_checksum(tx_buf, tx_len);
-  transfer.len = tx_len + 1;
-  ret = lltransfer(transfer);
-  if (ret < 0) {
-    SPILOG(LOGE, "SPI: failed to send data");
-    goto fail;
-  }
-
-  // Wait for (N)ACK
-  ret = wait_for_ack(SPI_DACK, 0x13, timeout, 3);
+  ret = send_and_wait_for_ack(tx_len + 1, SPI_DACK, 0x13, timeout, 3);
   if (ret < 0) {
     goto fail;
   }
@@ -390,7 +450,7 @@ int PandaSpiHandle::spi_transfer(uint8_t endpoint, uint8_t *tx_data, uint16_t tx
 
   transfer.len = rx_data_len + 1;
   transfer.rx_buf = (uint64_t)(rx_buf + 2 + 1);
-  ret = lltransfer(transfer);
+  ret = lltransfer(&transfer);
   if (ret < 0) {
     SPILOG(LOGE, "SPI: failed to read rx data");
     goto fail;
@@ -411,7 +471,7 @@ fail:
   // and ready for the next transfer
   int nack_cnt = 0;
   while (nack_cnt < 3) {
-    if (wait_for_ack(SPI_NACK, 0x14, 1, SPI_BUF_SIZE/2) == 0) {
+    if (wait_for_ack(SPI_NACK, 0x14, 1, SPI_BUF_SIZE/2, millis_since_boot()) == 0) {
       nack_cnt += 1;
     } else {
       nack_cnt = 0;
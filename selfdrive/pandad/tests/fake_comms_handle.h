@@ -0,0 +1,28 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+#include "selfdrive/pandad/panda_comms.h"
+
+// Records what is written to the panda, and accepts at most max_write bytes
+// per write like a panda whose TX buffer is full.
+class FakeCommsHandle : public PandaCommsHandle {
+public:
+  FakeCommsHandle() : PandaCommsHandle("") {}
+  int control_write(uint8_t request, uint16_t param1, uint16_t param2, unsigned int timeout=TIMEOUT) { return 0; }
+  int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout=TIMEOUT) { return 0; }
+  int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT) {
+    // like USB, a lost connection is nothing written
+    if (!connected) return 0;
+    int n = std::min(length, max_write);
+    written.insert(written.end(), data, data + n);
+    return n;
+  }
+  int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT) { return 0; }
+  void cleanup() {}
+
+  int max_write = INT_MAX;
+  std::vector<uint8_t> written;
+};
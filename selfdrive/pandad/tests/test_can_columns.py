@@ -0,0 +1,47 @@
+import gc
+import pytest
+
+from openpilot.selfdrive.pandad import can_list_to_can_capnp, can_capnp_to_list, CanColumnsParser
+
+MSGS = [
+  [(0x100, b'\x01\x02', 0), (0x200, b'', 1), (0x7ff, bytes(range(8)), 2)],
+  [],
+  [(0x18dafff1, bytes(range(64)), 0), (0x300, bytes(range(12)), 129), (0x400, bytes(range(48)), 4)],
+]
+
+
+def columns_to_list(columns):
+  nanos, frame_offsets, addresses, buses, dat_offsets, dat = columns
+  result = []
+  for m in range(len(nanos)):
+    frames = [(int(addresses[i]), dat[dat_offsets[i]:dat_offsets[i + 1]].tobytes(), int(buses[i]))
+              for i in range(frame_offsets[m], frame_offsets[m + 1])]
+    result.append((int(nanos[m]), frames))
+  return result
+
+
+class TestCanColumnsParser:
+
+  @pytest.mark.parametrize("msgtype", ["can", "sendcan"])
+  def test_matches_can_capnp_to_list(self, msgtype):
+    strings = [can_list_to_can_capnp(msgs, msgtype=msgtype) for msgs in MSGS]
+
+    parser = CanColumnsParser()
+    assert columns_to_list(parser.parse(strings, msgtype)) == can_capnp_to_list(strings, msgtype)
+
+    # the arena is reused, a smaller batch doesn't keep frames of the previous one
+    assert columns_to_list(parser.parse(strings[2:], msgtype)) == can_capnp_to_list(strings[2:], msgtype)
+
+  def test_empty(self):
+    nanos, frame_offsets, addresses, buses, dat_offsets, dat = CanColumnsParser().parse([])
+    assert len(nanos) == 0 and len(addresses) == 0 and len(dat) == 0
+    assert list(frame_offsets) == [0] and list(dat_offsets) == [0]
+
+  def test_views(self):
+    strings = [can_list_to_can_capnp(MSGS[0])]
+    # the parser is only referenced by its views
+    columns = CanColumnsParser().parse(strings)
+    gc.collect()
+    assert columns_to_list(columns) == can_capnp_to_list(strings)
+    for column in columns:
+      assert not column.flags.writeable
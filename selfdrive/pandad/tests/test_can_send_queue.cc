@@ -0,0 +1,153 @@
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "common/timing.h"
+#include "selfdrive/pandad/pandad.h"
+#include "selfdrive/pandad/tests/fake_comms_handle.h"
+
+struct SendQueuePanda : public Panda {
+  SendQueuePanda() : Panda(0U) {
+    comms = new FakeCommsHandle();
+    handle.reset(comms);
+  }
+
+  // the frames written so far, the stream must end on a frame boundary
+  std::vector<can_frame> written_frames() {
+    std::vector<can_frame> frames;
+    uint32_t size = comms->written.size();
+    REQUIRE(unpack_can_buffer(comms->written.data(), size, frames));
+    REQUIRE(size == 0);
+    comms->written.clear();
+    return frames;
+  }
+
+  FakeCommsHandle *comms;
+};
+
+static can_frame make_frame(long address, uint8_t value, long bus = 0) {
+  can_frame f = {.address = address, .src = bus, .size = 8};
+  f.dat[0] = value;
+  return f;
+}
+
+static void check_frames(const std::vector<can_frame> &frames, const std::vector<std::pair<long, uint8_t>> &expected) {
+  REQUIRE(frames.size() == expected.size());
+  for (int i = 0; i < frames.size(); ++i) {
+    REQUIRE(frames[i].address == expected[i].first);
+    REQUIRE(frames[i].dat[0] == expected[i].second);
+  }
+}
+
+TEST_CASE("CanSendQueue: superseded frames are skipped, order is kept") {
+  SendQueuePanda panda;
+  CanSendQueue queue(&panda);
+  const uint64_t now = nanos_since_boot();
+
+  queue.push({make_frame(0x100, 1), make_frame(0x200, 1)}, now);
+  // the first message is still pending, the frames for 0x100 and 0x200 supersede it
+  queue.push({make_frame(0x200, 2), make_frame(0x300, 2), make_frame(0x100, 2)}, now);
+  REQUIRE(queue.stats.coalesced == 2);
+  REQUIRE(queue.depth() == 3);
+
+  REQUIRE(queue.send());
+  check_frames(panda.written_frames(), {{0x200, 2}, {0x300, 2}, {0x100, 2}});
+  REQUIRE(queue.stats.sent == 3);
+  REQUIRE(queue.depth() == 0);
+  REQUIRE(!queue.pending());
+}
+
+TEST_CASE("CanSendQueue: frames of one sendcan message are all sent") {
+  SendQueuePanda panda;
+  CanSendQueue queue(&panda);
+  const uint64_t now = nanos_since_boot();
+
+  queue.push({make_frame(0x100, 1)}, now);
+  queue.push({make_frame(0x100, 2), make_frame(0x100, 3)}, now);
+  REQUIRE(queue.stats.coalesced == 1);
+
+  REQUIRE(queue.send());
+  check_frames(panda.written_frames(), {{0x100, 2}, {0x100, 3}});
+}
+
+TEST_CASE("CanSendQueue: the same address on another bus is a different frame") {
+  SendQueuePanda panda;
+  CanSendQueue queue(&panda);
+  const uint64_t now = nanos_since_boot();
+
+  queue.push({make_frame(0x100, 1, 0)}, now);
+  queue.push({make_frame(0x100, 2, 1)}, now);
+  REQUIRE(queue.stats.coalesced == 0);
+
+  REQUIRE(queue.send());
+  check_frames(panda.written_frames(), {{0x100, 1}, {0x100, 2}});
+}
+
+TEST_CASE("CanSendQueue: old frames expire") {
+  SendQueuePanda panda;
+  CanSendQueue queue(&panda);
+  const uint64_t now = nanos_since_boot();
+
+  queue.push({make_frame(0x100, 1), make_frame(0x200, 1)}, now - 2e9);
+  queue.push({make_frame(0x300, 2)}, now);
+
+  REQUIRE(queue.send());
+  check_frames(panda.written_frames(), {{0x300, 2}});
+  REQUIRE(queue.stats.expired == 2);
+  REQUIRE(queue.stats.sent == 1);
+}
+
+TEST_CASE("CanSendQueue: partial writes continue where the panda stopped") {
+  SendQueuePanda panda;
+  CanSendQueue queue(&panda);
+  panda.comms->max_write = 10;  // less than a frame
+
+  std::vector<can_frame> frames;
+  std::vector<std::pair<long, uint8_t>> expected;
+  for (int i = 0; i < 100; ++i) {
+    frames.push_back(make_frame(0x100 + i, i));
+    expected.push_back({0x100 + i, (uint8_t)i});
+  }
+  queue.push(frames, nanos_since_boot());
+
+  // frames count as sent once the panda has all of their bytes
+  const int frame_size = sizeof(can_header) + 8;
+  int sends = 1;
+  for (; !queue.send(); ++sends) {
+    REQUIRE(queue.pending());
+    REQUIRE(queue.stats.sent == panda.comms->written.size() / frame_size);
+  }
+  REQUIRE(sends > 1);
+  REQUIRE(queue.stats.backed_up == sends - 1);
+  REQUIRE(queue.stats.sent == 100);
+  check_frames(panda.written_frames(), expected);
+}
+
+TEST_CASE("CanSendQueue: frames are dropped when the panda is disconnected") {
+  SendQueuePanda panda;
+  CanSendQueue queue(&panda);
+
+  queue.push({make_frame(0x100, 1), make_frame(0x200, 1)}, nanos_since_boot());
+  panda.comms->connected = false;
+
+  REQUIRE(!queue.send());
+  REQUIRE(queue.stats.dropped == 2);
+  REQUIRE(queue.stats.sent == 0);
+  REQUIRE(!queue.pending());
+}
+
+TEST_CASE("CanSendQueue: unsent frames are dropped when the panda is disconnected") {
+  SendQueuePanda panda;
+  CanSendQueue queue(&panda);
+  panda.comms->max_write = sizeof(can_header) + 8 + 2;  // one frame and a bit
+
+  queue.push({make_frame(0x100, 1), make_frame(0x200, 1), make_frame(0x300, 1)}, nanos_since_boot());
+  REQUIRE(!queue.send());
+  REQUIRE(queue.stats.sent == 1);
+  REQUIRE(queue.stats.backed_up == 1);
+
+  panda.comms->connected = false;
+  REQUIRE(!queue.send());
+  REQUIRE(queue.stats.sent == 1);
+  REQUIRE(queue.stats.dropped == 2);
+  REQUIRE(!queue.pending());
+}
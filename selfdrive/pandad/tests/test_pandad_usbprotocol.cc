@@ -3,24 +3,32 @@
 
 #include "catch2/catch.hpp"
 #include "cereal/messaging/messaging.h"
+#include "common/timing.h"
 #include "common/util.h"
-#include "selfdrive/pandad/panda.h"
+#include "selfdrive/pandad/pandad.h"
+#include "selfdrive/pandad/tests/fake_comms_handle.h"
 
 struct PandaTest : public Panda {
   PandaTest(uint32_t bus_offset, int can_list_size, cereal::PandaState::PandaType hw_type);
   void test_can_send();
   void test_can_recv(uint32_t chunk_size = 0);
   void test_chunked_can_recv();
+  void benchmark_can_send();
+  void benchmark_can_recv();
+  // runs the test frames through pandad's send queue, returns the bytes written to the panda
+  std::vector<uint8_t> send_can_frames();
 
   std::map<int, std::string> test_data;
   int can_list_size = 0;
   int total_pakets_size = 0;
-  MessageBuilder msg;
-  capnp::List<cereal::CanData>::Reader can_data_list;
+  std::vector<can_frame> can_frames;
+  FakeCommsHandle *comms;
 };
 
 PandaTest::PandaTest(uint32_t bus_offset_, int can_list_size, cereal::PandaState::PandaType hw_type) : can_list_size(can_list_size), Panda(bus_offset_) {
   this->hw_type = hw_type;
+  comms = new FakeCommsHandle();
+  handle.reset(comms);
   int data_limit = ((hw_type == cereal::PandaState::PandaType::RED_PANDA) ? std::size(dlc_to_len) : 8);
   // prepare test data
   for (int i = 0; i < data_limit; ++i) {
@@ -34,26 +42,33 @@ PandaTest::PandaTest(uint32_t bus_offset_, int can_list_size, cereal::PandaState
   }
 
   // generate can messages for this panda
-  auto can_list = msg.initEvent().initSendcan(can_list_size);
   for (uint8_t i = 0; i < can_list_size; ++i) {
-    auto can = can_list[i];
     uint32_t id = util::random_int(0, std::size(dlc_to_len) - 1);
     const std::string &dat = test_data[dlc_to_len[id]];
-    can.setAddress(i);
-    can.setSrc(util::random_int(0, 2) + bus_offset);
-    can.setDat(kj::ArrayPtr((uint8_t *)dat.data(), dat.size()));
+    auto &f = can_frames.emplace_back();
+    f.address = i;
+    f.src = util::random_int(0, 2) + bus_offset;
+    f.size = dat.size();
+    memcpy(f.dat, dat.data(), dat.size());
     total_pakets_size += sizeof(can_header) + dat.size();
   }
 
-  can_data_list = can_list.asReader();
   INFO("test " << can_list_size << " packets, total size " << total_pakets_size);
 }
 
+std::vector<uint8_t> PandaTest::send_can_frames() {
+  CanSendQueue queue(this);
+  queue.push(can_frames, nanos_since_boot());
+  REQUIRE(queue.send());
+  REQUIRE(queue.stats.sent == can_list_size);
+
+  std::vector<uint8_t> written;
+  written.swap(comms->written);
+  return written;
+}
+
 void PandaTest::test_can_send() {
-  std::vector<uint8_t> unpacked_data;
-  this->pack_can_buffer(can_data_list, [&](uint8_t *chunk, size_t size) {
-    unpacked_data.insert(unpacked_data.end(), chunk, &chunk[size]);
-  });
+  std::vector<uint8_t> unpacked_data = send_can_frames();
   REQUIRE(unpacked_data.size() == total_pakets_size);
 
   int cnt = 0;
@@ -75,33 +90,58 @@ void PandaTest::test_can_send() {
 
 void PandaTest::test_can_recv(uint32_t rx_chunk_size) {
   std::vector<can_frame> frames;
-  this->pack_can_buffer(can_data_list, [&](uint8_t *data, uint32_t size) {
-    if (rx_chunk_size == 0) {
-      REQUIRE(this->unpack_can_buffer(data, size, frames));
-    } else {
-      this->receive_buffer_size = 0;
-      uint32_t pos = 0;
-
-      while (pos < size) {
-        uint32_t chunk_size = std::min(rx_chunk_size, size - pos);
-        memcpy(&this->receive_buffer[this->receive_buffer_size], &data[pos], chunk_size);
-        this->receive_buffer_size += chunk_size;
-        pos += chunk_size;
-
-        REQUIRE(this->unpack_can_buffer(this->receive_buffer, this->receive_buffer_size, frames));
-      }
+  std::vector<uint8_t> data = send_can_frames();
+  uint32_t size = data.size();
+  if (rx_chunk_size == 0) {
+    REQUIRE(this->unpack_can_buffer(data.data(), size, frames));
+  } else {
+    this->receive_buffer_size = 0;
+    uint32_t pos = 0;
+
+    while (pos < size) {
+      uint32_t chunk_size = std::min(rx_chunk_size, size - pos);
+      memcpy(&this->receive_buffer[this->receive_buffer_size], &data[pos], chunk_size);
+      this->receive_buffer_size += chunk_size;
+      pos += chunk_size;
+
+      REQUIRE(this->unpack_can_buffer(this->receive_buffer, this->receive_buffer_size, frames));
     }
-  });
+  }
 
   REQUIRE(frames.size() == can_list_size);
   for (int i = 0; i < frames.size(); ++i) {
     REQUIRE(frames[i].address == i);
-    REQUIRE(test_data.find(frames[i].dat.size()) != test_data.end());
-    const std::string &dat = test_data[frames[i].dat.size()];
-    REQUIRE(memcmp(dat.data(), frames[i].dat.data(), dat.size()) == 0);
+    REQUIRE(test_data.find(frames[i].size) != test_data.end());
+    const std::string &dat = test_data[frames[i].size];
+    REQUIRE(memcmp(dat.data(), frames[i].dat, dat.size()) == 0);
   }
 }
 
+void PandaTest::benchmark_can_send() {
+  CanSendQueue queue(this);
+  comms->written.reserve(total_pakets_size);
+  BENCHMARK("CanSendQueue " + std::to_string(can_list_size) + " packets") {
+    comms->written.clear();
+    queue.stats.latency_ms.clear();
+    queue.push(can_frames, nanos_since_boot());
+    return queue.send();
+  };
+}
+
+void PandaTest::benchmark_can_recv() {
+  std::vector<uint8_t> packed = send_can_frames();
+  REQUIRE(packed.size() <= RECV_SIZE);
+
+  std::vector<can_frame> frames;
+  frames.reserve(can_list_size);
+  BENCHMARK("unpack_can_buffer " + std::to_string(can_list_size) + " packets") {
+    frames.clear();
+    memcpy(this->receive_buffer, packed.data(), packed.size());
+    this->receive_buffer_size = packed.size();
+    return this->unpack_can_buffer(this->receive_buffer, this->receive_buffer_size, frames);
+  };
+}
+
 TEST_CASE("send/recv CAN 2.0 packets") {
   auto bus_offset = GENERATE(0, 4);
   auto can_list_size = GENERATE(1, 3, 5, 10, 30, 60, 100, 200);
@@ -133,3 +173,10 @@ TEST_CASE("send/recv CAN FD packets") {
     test.test_can_recv(0x40);
   }
 }
+
+TEST_CASE("CAN packing benchmark", "[!benchmark]") {
+  auto hw_type = GENERATE(cereal::PandaState::PandaType::DOS, cereal::PandaState::PandaType::RED_PANDA);
+  PandaTest test(0, 200, hw_type);
+  test.benchmark_can_send();
+  test.benchmark_can_recv();
+}
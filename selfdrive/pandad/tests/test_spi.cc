@@ -0,0 +1,82 @@
+#ifndef __APPLE__
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "common/timing.h"
+#include "selfdrive/pandad/panda_comms.h"
+
+#define SPI_HACK 0x79U
+#define SPI_NACK 0x1FU
+
+// Stands in for spidev: every poll is answered with the next scripted byte,
+// and with not ready once the script runs out.
+class MockSpiHandle : public PandaSpiHandle {
+public:
+  using PandaSpiHandle::send_and_wait_for_ack;
+
+  int lltransfer(spi_ioc_transfer *transfers, int count = 1) override {
+    ioctls++;
+    transfers_sent += count;
+    if (count == 2 && send_delay_ms > 0) {
+      usleep(send_delay_ms * 1000);
+    }
+    spi_ioc_transfer &poll = transfers[count - 1];
+    uint8_t reply = polls < replies.size() ? replies[polls] : 0x00;
+    polls++;
+    memset((uint8_t *)poll.rx_buf, reply, poll.len);
+    return poll.len;
+  }
+
+  std::vector<uint8_t> replies;
+  int send_delay_ms = 0;
+  int ioctls = 0, transfers_sent = 0, polls = 0;
+};
+
+TEST_CASE("SPI: ACK on the first poll is a single ioctl") {
+  MockSpiHandle spi;
+  spi.replies = {SPI_HACK};
+
+  REQUIRE(spi.send_and_wait_for_ack(7, SPI_HACK, 0x11, 100, 1) == 0);
+  REQUIRE(spi.ioctls == 1);
+  REQUIRE(spi.transfers_sent == 2);
+}
+
+TEST_CASE("SPI: NACK on the first poll") {
+  MockSpiHandle spi;
+  spi.replies = {SPI_NACK};
+
+  REQUIRE(spi.send_and_wait_for_ack(7, SPI_HACK, 0x11, 100, 1) == SpiError::NACK);
+  REQUIRE(spi.ioctls == 1);
+}
+
+TEST_CASE("SPI: not ready on the first poll keeps polling") {
+  MockSpiHandle spi;
+
+  SECTION("until ACK") {
+    spi.replies = {0x00, 0x00, SPI_HACK};
+    REQUIRE(spi.send_and_wait_for_ack(7, SPI_HACK, 0x11, 100, 1) == 0);
+    REQUIRE(spi.ioctls == 3);
+    REQUIRE(spi.transfers_sent == 4);
+  }
+
+  SECTION("until NACK") {
+    spi.replies = {0x00, SPI_NACK};
+    REQUIRE(spi.send_and_wait_for_ack(7, SPI_HACK, 0x11, 100, 1) == SpiError::NACK);
+    REQUIRE(spi.ioctls == 2);
+  }
+
+  SECTION("until the timeout, counted from the send") {
+    const unsigned int timeout = 100;
+    spi.send_delay_ms = 60;
+    const double start = millis_since_boot();
+    REQUIRE(spi.send_and_wait_for_ack(7, SPI_HACK, 0x11, timeout, 1) == SpiError::ACK_TIMEOUT);
+    const double elapsed = millis_since_boot() - start;
+    REQUIRE(elapsed >= timeout);
+    // a slow send leaves less time to poll, it does not restart the timeout
+    REQUIRE(elapsed < timeout + spi.send_delay_ms / 2);
+  }
+}
+#endif
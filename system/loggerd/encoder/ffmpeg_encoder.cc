@@ -26,19 +26,41 @@ const int env_debug_encoder = (getenv("DEBUG_ENCODER") != NULL) ? atoi(getenv("D
 
 FfmpegEncoder::FfmpegEncoder(const EncoderInfo &encoder_info, int in_width, int in_height)
     : VideoEncoder(encoder_info, in_width, in_height) {
+  software = ENCODERD_SOFTWARE && encoder_info.encode_type != cereal::EncodeIndex::Type::BIG_BOX_LOSSLESS;
+  if (software) {
+    const char *name = encoder_info.encode_type == cereal::EncodeIndex::Type::FULL_H_E_V_C ? "libx265" : "libx264";
+    codec = avcodec_find_encoder_by_name(name);
+    if (!codec) LOGE("ffmpeg is built without %s", name);
+  } else {
+    codec = avcodec_find_encoder(AV_CODEC_ID_FFVHUFF);
+  }
+  assert(codec);
+
   frame = av_frame_alloc();
   assert(frame);
-  frame->format = AV_PIX_FMT_YUV420P;
   frame->width = out_width;
   frame->height = out_height;
-  frame->linesize[0] = out_width;
-  frame->linesize[1] = out_width/2;
-  frame->linesize[2] = out_width/2;
 
-  convert_buf.resize(in_width * in_height * 3 / 2);
+  const bool downscale = in_width != out_width || in_height != out_height;
+  bool nv12_supported = false;
+  for (auto fmt = codec->pix_fmts; fmt && *fmt != AV_PIX_FMT_NONE; ++fmt) {
+    nv12_supported |= *fmt == AV_PIX_FMT_NV12;
+  }
 
-  if (in_width != out_width || in_height != out_height) {
-    downscale_buf.resize(out_width * out_height * 3 / 2);
+  if (nv12_supported && !downscale) {
+    // the VisionBuf is passed to the codec as is
+    frame->format = AV_PIX_FMT_NV12;
+  } else {
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->linesize[0] = out_width;
+    frame->linesize[1] = out_width/2;
+    frame->linesize[2] = out_width/2;
+    if (downscale) {
+      // I420 output plus the interleaved downscaled UV plane
+      downscale_buf.resize(out_width * out_height * 3 / 2 + (out_width / 2) * (out_height / 2) * 2);
+    } else {
+      convert_buf.resize(in_width * in_height * 3 / 2);
+    }
   }
 }
 
@@ -48,20 +70,36 @@ FfmpegEncoder::~FfmpegEncoder() {
 }
 
 void FfmpegEncoder::encoder_open(const char* path) {
-  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_FFVHUFF);
-
   this->codec_ctx = avcodec_alloc_context3(codec);
   assert(this->codec_ctx);
   this->codec_ctx->width = frame->width;
   this->codec_ctx->height = frame->height;
-  this->codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  this->codec_ctx->pix_fmt = (AVPixelFormat)frame->format;
   this->codec_ctx->time_base = (AVRational){ 1, encoder_info.fps };
-  int err = avcodec_open2(this->codec_ctx, codec, NULL);
+
+  AVDictionary *opts = NULL;
+  if (software) {
+    // same rate control and GOP as the hardware encoder, with headers in every keyframe
+    this->codec_ctx->time_base = (AVRational){ 1, 1000000 };
+    this->codec_ctx->framerate = (AVRational){ encoder_info.fps, 1 };
+    this->codec_ctx->bit_rate = encoder_info.bitrate;
+    this->codec_ctx->gop_size = encoder_info.encode_type == cereal::EncodeIndex::Type::FULL_H_E_V_C ? 30 : 15;
+    this->codec_ctx->max_b_frames = 0;
+    av_dict_set(&opts, "preset", "veryfast", 0);
+    // one packet out for every frame in
+    av_dict_set(&opts, "tune", "zerolatency", 0);
+    if (encoder_info.encode_type == cereal::EncodeIndex::Type::FULL_H_E_V_C) {
+      av_dict_set(&opts, "x265-params", "log-level=error", 0);
+    }
+  }
+  int err = avcodec_open2(this->codec_ctx, codec, &opts);
+  av_dict_free(&opts);
   assert(err >= 0);
 
   is_open = true;
   segment_num++;
   counter = 0;
+  frames_in = 0;
 }
 
 void FfmpegEncoder::encoder_close() {
@@ -75,38 +113,50 @@ int FfmpegEncoder::encode_frame(VisionBuf* buf, VisionIpcBufExtra *extra) {
   assert(buf->width == this->in_width);
   assert(buf->height == this->in_height);
 
-  uint8_t *cy = convert_buf.data();
-  uint8_t *cu = cy + in_width * in_height;
-  uint8_t *cv = cu + (in_width / 2) * (in_height / 2);
-  libyuv::NV12ToI420(buf->y, buf->stride,
-                     buf->uv, buf->stride,
-                     cy, in_width,
-                     cu, in_width/2,
-                     cv, in_width/2,
-                     in_width, in_height);
-
-  if (downscale_buf.size() > 0) {
+  if (frame->format == AV_PIX_FMT_NV12) {
+    frame->data[0] = buf->y;
+    frame->data[1] = buf->uv;
+    frame->linesize[0] = buf->stride;
+    frame->linesize[1] = buf->stride;
+  } else if (downscale_buf.size() > 0) {
+    // downscale straight from NV12, without an I420 copy at the input resolution.
+    // point sampling the UV plane as 16 bit pixels keeps the U and V of a pair together.
     uint8_t *out_y = downscale_buf.data();
     uint8_t *out_u = out_y + frame->width * frame->height;
     uint8_t *out_v = out_u + (frame->width / 2) * (frame->height / 2);
-    libyuv::I420Scale(cy, in_width,
-                      cu, in_width/2,
-                      cv, in_width/2,
-                      in_width, in_height,
-                      out_y, frame->width,
-                      out_u, frame->width/2,
-                      out_v, frame->width/2,
-                      frame->width, frame->height,
-                      libyuv::kFilterNone);
+    uint8_t *out_uv = out_v + (frame->width / 2) * (frame->height / 2);
+    libyuv::ScalePlane(buf->y, buf->stride,
+                       in_width, in_height,
+                       out_y, frame->width,
+                       frame->width, frame->height,
+                       libyuv::kFilterNone);
+    libyuv::ScalePlane_16((const uint16_t *)buf->uv, buf->stride / 2,
+                          in_width / 2, in_height / 2,
+                          (uint16_t *)out_uv, frame->width / 2,
+                          frame->width / 2, frame->height / 2,
+                          libyuv::kFilterNone);
+    libyuv::SplitUVPlane(out_uv, frame->width,
+                         out_u, frame->width / 2,
+                         out_v, frame->width / 2,
+                         frame->width / 2, frame->height / 2);
     frame->data[0] = out_y;
     frame->data[1] = out_u;
     frame->data[2] = out_v;
   } else {
+    uint8_t *cy = convert_buf.data();
+    uint8_t *cu = cy + in_width * in_height;
+    uint8_t *cv = cu + (in_width / 2) * (in_height / 2);
+    libyuv::NV12ToI420(buf->y, buf->stride,
+                       buf->uv, buf->stride,
+                       cy, in_width,
+                       cu, in_width/2,
+                       cv, in_width/2,
+                       in_width, in_height);
     frame->data[0] = cy;
     frame->data[1] = cu;
     frame->data[2] = cv;
   }
-  frame->pts = counter*50*1000; // 50ms per frame
+  frame->pts = frames_in++ * 50 * 1000;  // 50ms per frame
 
   int ret = counter;
 
@@ -25,8 +25,11 @@ public:
 private:
   int segment_num = -1;
   int counter = 0;
+  int64_t frames_in = 0;
   bool is_open = false;
+  bool software = false;  // libx265/libx264 instead of FFVHUFF
 
+  const AVCodec *codec = nullptr;
   AVCodecContext *codec_ctx;
   AVFrame *frame = NULL;
   std::vector<uint8_t> convert_buf;
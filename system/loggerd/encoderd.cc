@@ -1,5 +1,6 @@
 #include <cassert>
 
+#include "common/queue.h"
 #include "system/loggerd/loggerd.h"
 
 #ifdef QCOM2
@@ -43,12 +44,76 @@ bool sync_encoders(EncoderdState *s, CameraType cam_type, uint32_t frame_id) {
   }
 }
 
+// Each encoder of a camera runs on its own thread, so a slow encoder doesn't hold up the others.
+// Frames are passed by reference, a frame camerad reused before it was encoded is dropped.
+struct EncoderStage {
+  struct Frame {
+    VisionBuf *buf;
+    VisionIpcBufExtra extra;
+    bool rotate;  // start a new segment before this frame
+  };
+  static constexpr int MAX_QUEUED_FRAMES = 2;
+
+  EncoderStage(const EncoderInfo &encoder_info, int width, int height)
+      : name(encoder_info.publish_name), encoder(new Encoder(encoder_info, width, height)) {
+    encoder->encoder_open(nullptr);
+    thread = std::thread(&EncoderStage::run, this);
+  }
+  ~EncoderStage() {
+    thread.join();
+  }
+
+  void push(VisionBuf *buf, const VisionIpcBufExtra &extra, bool rotate) {
+    // a rotation is never dropped
+    if (!rotate && queue.size() >= MAX_QUEUED_FRAMES) {
+      ++dropped_queue_full;
+      return;
+    }
+    queue.push({.buf = buf, .extra = extra, .rotate = rotate});
+  }
+
+  void run() {
+    Frame frame;
+    while (!do_exit) {
+      if (!queue.try_pop(frame, 50)) continue;
+
+      if (frame.rotate) {
+        // report the frames dropped in the last segment
+        const int queue_full = dropped_queue_full.exchange(0);
+        if (queue_full > 0 || dropped_overwritten > 0) {
+          LOGW("encoder %s dropped %d frames, queue full %d overwritten %d", name, queue_full + dropped_overwritten,
+               queue_full, dropped_overwritten);
+          dropped_overwritten = 0;
+        }
+        encoder->encoder_close();
+        encoder->encoder_open(nullptr);
+      }
+      if (frame.buf->get_frame_id() != frame.extra.frame_id) {
+        ++dropped_overwritten;
+        continue;
+      }
+
+      int out_id = encoder->encode_frame(frame.buf, &frame.extra);
+      if (out_id == -1) {
+        LOGE("Failed to encode frame. frame_id: %d", frame.extra.frame_id);
+      }
+    }
+  }
+
+  const char *name;
+  std::unique_ptr<Encoder> encoder;
+  SafeQueue<Frame> queue;
+  std::atomic<int> dropped_queue_full = 0;
+  int dropped_overwritten = 0;  // only accessed by the stage's thread
+  std::thread thread;
+};
 
 void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
   util::set_thread_name(cam_info.thread_name);
 
-  std::vector<std::unique_ptr<Encoder>> encoders;
   VisionIpcClient vipc_client = VisionIpcClient("camerad", cam_info.stream_type, false);
+  // destroyed before the client, the stages hold on to its buffers
+  std::vector<std::unique_ptr<EncoderStage>> encoders;
 
   int cur_seg = 0;
   while (!do_exit) {
@@ -64,8 +129,7 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
       assert(buf_info.width > 0 && buf_info.height > 0);
 
       for (const auto &encoder_info : cam_info.encoder_infos) {
-        auto &e = encoders.emplace_back(new Encoder(encoder_info, buf_info.width, buf_info.height));
-        e->encoder_open(nullptr);
+        encoders.emplace_back(new EncoderStage(encoder_info, buf_info.width, buf_info.height));
       }
     }
 
@@ -92,21 +156,15 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
 
       // do rotation if required
       const int frames_per_seg = SEGMENT_LENGTH * MAIN_FPS;
+      bool rotate = false;
       if (cur_seg >= 0 && extra.frame_id >= ((cur_seg + 1) * frames_per_seg) + s->start_frame_id) {
-        for (auto &e : encoders) {
-          e->encoder_close();
-          e->encoder_open(NULL);
-        }
+        rotate = true;
         ++cur_seg;
       }
 
-      // encode a frame
-      for (int i = 0; i < encoders.size(); ++i) {
-        int out_id = encoders[i]->encode_frame(buf, &extra);
-
-        if (out_id == -1) {
-          LOGE("Failed to encode frame. frame_id: %d", extra.frame_id);
-        }
+      // hand the frame to the encoders
+      for (auto &e : encoders) {
+        e->push(buf, extra, rotate);
       }
     }
   }
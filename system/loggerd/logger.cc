@@ -1,5 +1,10 @@
 #include "system/loggerd/logger.h"
 
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <cmath>
 #include <fstream>
 #include <map>
 #include <vector>
@@ -118,38 +123,365 @@ static void log_sentinel(LoggerState *log, SentinelType type, int exit_signal =
   auto sen = msg.initEvent().initSentinel();
   sen.setType(type);
   sen.setSignal(exit_signal);
-  log->write(msg.toBytes(), true);
+  log->write(msg, true);
+}
+
+// ***** RawFile *****
+
+RawFile::RawFile(const std::string &path, int zstd_level) {
+  fd = HANDLE_EINTR(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+  assert(fd >= 0);
+  if (zstd_level > 0) {
+    cctx = ZSTD_createCCtx();
+    assert(cctx != nullptr);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, zstd_level);
+    out_buf.resize(ZSTD_CStreamOutSize());
+  }
+}
+
+RawFile::~RawFile() {
+  if (cctx) {
+    if (frame_size > 0) compress(nullptr, 0, ZSTD_e_end);
+    ZSTD_freeCCtx(cctx);
+  }
+  if (preallocated) {
+    // give back the preallocated space past the end of the file
+    HANDLE_EINTR(ftruncate(fd, lseek(fd, 0, SEEK_CUR)));
+  }
+  int err = close(fd);
+  assert(err == 0);
+}
+
+size_t RawFile::write(const void *data, size_t size) {
+  struct iovec iov = {.iov_base = (void *)data, .iov_len = size};
+  return writev(&iov, 1);
+}
+
+size_t RawFile::writev(struct iovec *iov, int iovcnt) {
+  if (!cctx) return writeFd(iov, iovcnt);
+
+  size_t written = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    written += compress(iov[i].iov_base, iov[i].iov_len, ZSTD_e_continue);
+  }
+  // frames end on a message boundary
+  if (frame_size >= ZSTD_FRAME_SIZE) {
+    written += compress(nullptr, 0, ZSTD_e_end);
+  }
+  return written;
+}
+
+void RawFile::preallocate(size_t size) {
+#ifdef __linux__
+  // KEEP_SIZE leaves the file size alone, readers only see what was written
+  preallocated = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0;
+#endif
+}
+
+size_t RawFile::flush() {
+  return cctx && frame_size > 0 ? compress(nullptr, 0, ZSTD_e_flush) : 0;
+}
+
+size_t RawFile::writeFd(struct iovec *iov, int iovcnt) {
+  size_t written = 0;
+  while (iovcnt > 0) {
+    ssize_t n = HANDLE_EINTR(::writev(fd, iov, std::min(iovcnt, IOV_MAX)));
+    assert(n >= 0);
+    written += n;
+    // skip what was written, short writes continue in the middle of an iovec
+    for (; iovcnt > 0 && (size_t)n >= iov->iov_len; ++iov, --iovcnt) {
+      n -= iov->iov_len;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return written;
+}
+
+size_t RawFile::compress(const void *data, size_t size, ZSTD_EndDirective mode) {
+  frame_size += size;
+  size_t written = 0, remaining = 0;
+  ZSTD_inBuffer input = {data, size, 0};
+  do {
+    ZSTD_outBuffer output = {out_buf.data(), out_buf.size(), 0};
+    remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+    assert(!ZSTD_isError(remaining));
+    if (output.pos > 0) {
+      struct iovec iov = {.iov_base = out_buf.data(), .iov_len = output.pos};
+      written += writeFd(&iov, 1);
+    }
+  } while (mode == ZSTD_e_continue ? input.pos < input.size : remaining > 0);
+
+  if (mode == ZSTD_e_end) frame_size = 0;
+  return written;
+}
+
+// ***** AsyncLogWriter *****
+
+AsyncLogWriter::AsyncLogWriter(size_t capacity) : capacity(capacity), ring(new uint8_t[capacity]) {
+  assert(capacity % sizeof(RecordHeader) == 0);
+  rlog_iovs.reserve(MAX_IOVS);
+  qlog_iovs.reserve(MAX_IOVS);
+  thread = std::thread(&AsyncLogWriter::writerThread, this);
+}
+
+AsyncLogWriter::~AsyncLogWriter() {
+  exit = true;
+  cv.notify_one();
+  thread.join();
+}
+
+void AsyncLogWriter::write(const uint8_t *data, size_t size, bool in_qlog) {
+  if (isLarge(size)) {
+    // don't let a single message block the ring, pass it by pointer
+    auto copy = new std::string((const char *)data, size);
+    push(in_qlog ? LARGE_RLOG_AND_QLOG : LARGE_RLOG, &copy, sizeof(copy));
+  } else {
+    push(in_qlog ? RLOG_AND_QLOG : RLOG, data, size);
+  }
+}
+
+void AsyncLogWriter::write(MessageBuilder &msg, bool in_qlog) {
+  const size_t size = msg.getSerializedSize();
+  if (isLarge(size)) {
+    auto bytes = msg.toBytes();
+    write(bytes.begin(), bytes.size(), in_qlog);
+  } else {
+    msg.serializeToBuffer(reserve(in_qlog ? RLOG_AND_QLOG : RLOG, size), size);
+    commit();
+  }
+}
+
+void AsyncLogWriter::setFiles(std::unique_ptr<LogSegmentFiles> new_files) {
+  auto ptr = new_files.release();
+  push(SET_FILES, &ptr, sizeof(ptr));
+  cv.notify_one();
 }
 
-LoggerState::LoggerState(const std::string &log_root) {
+void AsyncLogWriter::push(RecordType type, const void *data, size_t size) {
+  memcpy(reserve(type, size), data, size);
+  commit();
+}
+
+uint8_t *AsyncLogWriter::reserve(RecordType type, size_t size) {
+  const size_t record_size = sizeof(RecordHeader) + ((size + sizeof(RecordHeader) - 1) & ~(sizeof(RecordHeader) - 1));
+  size_t h = head.load(std::memory_order_relaxed);
+  size_t offset = h % capacity;
+  // records never wrap around, skip the end of the ring if it is too small
+  const size_t padding = capacity - offset < record_size ? capacity - offset : 0;
+
+  bool stalled = false;
+  while (h + padding + record_size - tail.load(std::memory_order_acquire) > capacity) {
+    if (!stalled) {
+      stalled = true;
+      cv.notify_one();
+    }
+    util::sleep_for(1);
+  }
+  if (stalled) {
+    std::lock_guard lk(stats_lock);
+    ++stats_.stalls;
+  }
+
+  if (padding > 0) {
+    *(RecordHeader *)(ring.get() + offset) = {.type = PADDING, .size = (uint32_t)padding};
+    h += padding;
+    offset = 0;
+  }
+  *(RecordHeader *)(ring.get() + offset) = {.type = type, .size = (uint32_t)size};
+  reserved_head = h + record_size;
+  return ring.get() + offset + sizeof(RecordHeader);
+}
+
+void AsyncLogWriter::commit() {
+  head.store(reserved_head, std::memory_order_release);
+}
+
+void AsyncLogWriter::writerThread() {
+  util::set_thread_name("loggerd_writer");
+
+  while (true) {
+    const bool exiting = exit;
+    size_t t = tail.load(std::memory_order_relaxed);
+    const size_t h = head.load(std::memory_order_acquire);
+    {
+      std::lock_guard lk(stats_lock);
+      stats_.queue_bytes = h - t;
+      stats_.max_queue_bytes = std::max(stats_.max_queue_bytes, h - t);
+    }
+
+    // messages are written from where they are in the ring,
+    // the tail only moves past them once they are written out
+    while (t != h) {
+      uint8_t *record = ring.get() + t % capacity;
+      const auto &header = *(const RecordHeader *)record;
+      uint8_t *data = record + sizeof(RecordHeader);
+
+      switch (header.type) {
+        case RLOG:
+        case RLOG_AND_QLOG:
+        case LARGE_RLOG:
+        case LARGE_RLOG_AND_QLOG: {
+          struct iovec iov = {.iov_base = data, .iov_len = header.size};
+          if (header.type == LARGE_RLOG || header.type == LARGE_RLOG_AND_QLOG) {
+            auto &large = large_msgs.emplace_back(*(std::string **)data);
+            iov = {.iov_base = large->data(), .iov_len = large->size()};
+          }
+          rlog_iovs.push_back(iov);
+          if (header.type == RLOG_AND_QLOG || header.type == LARGE_RLOG_AND_QLOG) qlog_iovs.push_back(iov);
+          pending_bytes += iov.iov_len;
+          break;
+        }
+        case SET_FILES:
+          writePending();
+          closeFiles();
+          files.reset(*(LogSegmentFiles **)data);
+          break;
+      }
+
+      t += header.type == PADDING ? header.size
+                                  : sizeof(RecordHeader) + ((header.size + sizeof(RecordHeader) - 1) & ~(sizeof(RecordHeader) - 1));
+      if (pending_bytes >= BLOCK_SIZE || rlog_iovs.size() >= MAX_IOVS) {
+        writePending();
+      }
+      if (rlog_iovs.empty()) {
+        tail.store(t, std::memory_order_release);
+      }
+    }
+    writePending();
+    tail.store(t, std::memory_order_release);
+
+    if (exiting) break;
+
+    if (millis_since_boot() - last_flush_ms >= COMPRESSED_FLUSH_INTERVAL_MS) {
+      flushFiles();
+    }
+
+    // wait for more data, writes are coalesced over this period
+    std::unique_lock lk(lock);
+    cv.wait_for(lk, std::chrono::milliseconds(10), [this]() { return exit.load(); });
+  }
+  closeFiles();
+}
+
+void AsyncLogWriter::writePending() {
+  writeFile(files ? files->rlog.get() : nullptr, rlog_iovs);
+  writeFile(files ? files->qlog.get() : nullptr, qlog_iovs);
+  large_msgs.clear();
+  pending_bytes = 0;
+}
+
+void AsyncLogWriter::writeFile(RawFile *file, std::vector<struct iovec> &iovs) {
+  if (file && !iovs.empty()) {
+    size_t size = 0;
+    for (const auto &iov : iovs) size += iov.iov_len;
+
+    double start = millis_since_boot();
+    size_t written = file->writev(iovs.data(), iovs.size());
+    addWriteStats(start, size, written);
+  }
+  iovs.clear();
+}
+
+void AsyncLogWriter::flushFiles() {
+  last_flush_ms = millis_since_boot();
+  if (files && files->rlog->compressed()) {
+    for (auto &file : {files->rlog.get(), files->qlog.get()}) {
+      double start = millis_since_boot();
+      size_t written = file->flush();
+      if (written > 0) addWriteStats(start, 0, written);
+    }
+  }
+}
+
+void AsyncLogWriter::addWriteStats(double start_ms, size_t size_in, size_t size_out) {
+  double dt = millis_since_boot() - start_ms;
+
+  std::lock_guard lk(stats_lock);
+  stats_.bytes_written += size_out;
+  stats_.bytes_in += size_in;
+  ++stats_.writes;
+  stats_.max_write_ms = std::max(stats_.max_write_ms, dt);
+  int bucket = dt * 1000 >= 1 ? std::log2(dt * 1000) : 0;
+  ++stats_.write_latency_hist[std::min<int>(bucket, stats_.write_latency_hist.size() - 1)];
+}
+
+void AsyncLogWriter::closeFiles() {
+  if (files) {
+    std::string lock_file = files->lock_file;
+    // the files end their zstd frames when they are closed
+    files.reset();
+    if (!lock_file.empty()) std::remove(lock_file.c_str());
+  }
+}
+
+AsyncLogWriter::Stats AsyncLogWriter::stats() {
+  std::lock_guard lk(stats_lock);
+  return stats_;
+}
+
+// ***** LoggerState *****
+
+LoggerState::LoggerState(const std::string &log_root, int zstd_level) : zstd_level(zstd_level) {
   route_name = logger_get_identifier("RouteCount");
   route_path = log_root + "/" + route_name;
   init_data = logger_build_init_data();
 }
 
 LoggerState::~LoggerState() {
-  if (rlog) {
+  if (part >= 0) {
+    // the writer closes the files and removes the lock file when it exits
     log_sentinel(this, SentinelType::END_OF_ROUTE, exit_signal);
-    std::remove(lock_file.c_str());
+  }
+  if (next_segment.valid()) {
+    // remove the segment that was prepared but never logged to
+    const std::string path = next_segment.get()->path;
+    const std::string ext = zstd_level > 0 ? ".zst" : "";
+    for (const std::string fn : {"/rlog.lock", "/rlog" + ext, "/qlog" + ext}) {
+      std::remove((path + fn).c_str());
+    }
+    rmdir(path.c_str());
   }
 }
 
+// Segments are prepared under a temporary name and only get their real name in next(),
+// so a crash or power loss never leaves an empty segment behind for the uploader.
+std::unique_ptr<LogSegmentFiles> LoggerState::prepareSegment(int segment) {
+  auto files = std::make_unique<LogSegmentFiles>();
+  files->path = route_path + "--" + std::to_string(segment) + PREPARED_SEGMENT_SUFFIX;
+  bool ret = util::create_directories(files->path, 0775);
+  assert(ret == true);
+
+  const std::string rlog_path = files->path + "/rlog";
+  const std::string ext = zstd_level > 0 ? ".zst" : "";
+  files->lock_file = rlog_path + ".lock";
+  std::ofstream{files->lock_file};
+  files->rlog.reset(new RawFile(rlog_path + ext, zstd_level));
+  files->qlog.reset(new RawFile(files->path + "/qlog" + ext, zstd_level));
+  // a minute of logs is typically well below this
+  files->rlog->preallocate((zstd_level > 0 ? 16 : 128) * 1024 * 1024);
+  files->qlog->preallocate((zstd_level > 0 ? 1 : 8) * 1024 * 1024);
+  return files;
+}
+
 bool LoggerState::next() {
-  if (rlog) {
+  if (part >= 0) {
     log_sentinel(this, SentinelType::END_OF_SEGMENT);
-    std::remove(lock_file.c_str());
   }
 
-  segment_path = route_path + "--" + std::to_string(++part);
-  bool ret = util::create_directories(segment_path, 0775);
-  assert(ret == true);
-
-  const std::string rlog_path = segment_path + "/rlog";
-  lock_file = rlog_path + ".lock";
-  std::ofstream{lock_file};
-
-  rlog.reset(new RawFile(rlog_path));
-  qlog.reset(new RawFile(segment_path + "/qlog"));
+  // usually the segment is ready by now and this is just a pointer swap
+  auto files = next_segment.valid() ? next_segment.get() : prepareSegment(part + 1);
+  segment_path = route_path + "--" + std::to_string(part + 1);
+  int ret = rename(files->path.c_str(), segment_path.c_str());
+  assert(ret == 0);
+  files->path = segment_path;
+  files->lock_file = segment_path + "/rlog.lock";
+  ++part;
+  // the previous segment is closed and unlocked after all its messages are written
+  writer.setFiles(std::move(files));
+  next_segment = std::async(std::launch::async, &LoggerState::prepareSegment, this, part + 1);
 
   // log init data & sentinel type.
   write(init_data.asBytes(), true);
@@ -158,6 +490,5 @@ bool LoggerState::next() {
 }
 
 void LoggerState::write(uint8_t* data, size_t size, bool in_qlog) {
-  rlog->write(data, size);
-  if (in_qlog) qlog->write(data, size);
+  writer.write(data, size, in_qlog);
 }
@@ -1,8 +1,18 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/uio.h>
+#include <zstd.h>
 
 #include "cereal/messaging/messaging.h"
 #include "common/util.h"
@@ -10,45 +20,141 @@
 
 class RawFile {
  public:
-  RawFile(const std::string &path) {
-    file = util::safe_fopen(path.c_str(), "wb");
-    assert(file != nullptr);
-  }
-  ~RawFile() {
-    util::safe_fflush(file);
-    int err = fclose(file);
-    assert(err == 0);
-  }
-  inline void write(void* data, size_t size) {
-    int written = util::safe_fwrite(data, 1, size, file);
-    assert(written == size);
-  }
-  inline void write(kj::ArrayPtr<capnp::byte> array) { write(array.begin(), array.size()); }
+  // with zstd_level > 0 the file is written as a sequence of independent zstd frames,
+  // each holding up to ZSTD_FRAME_SIZE bytes of input, so a reader can start at any frame
+  RawFile(const std::string &path, int zstd_level = 0);
+  ~RawFile();
+  // the write functions return the number of bytes written to disk
+  size_t write(const void* data, size_t size);
+  inline size_t write(kj::ArrayPtr<capnp::byte> array) { return write(array.begin(), array.size()); }
+  // gather write, iov is modified
+  size_t writev(struct iovec *iov, int iovcnt);
+  // compressed data is buffered in zstd until flushed, everything written before can then be decoded
+  size_t flush();
+  // reserve disk space ahead of the writes, the unused part is released when the file is closed
+  void preallocate(size_t size);
+  inline bool compressed() const { return cctx != nullptr; }
+
+  static constexpr size_t ZSTD_FRAME_SIZE = 4 * 1024 * 1024;
 
  private:
-  FILE* file = nullptr;
+  size_t writeFd(struct iovec *iov, int iovcnt);
+  size_t compress(const void *data, size_t size, ZSTD_EndDirective mode);
+
+  int fd = -1;
+  bool preallocated = false;
+  ZSTD_CCtx *cctx = nullptr;
+  size_t frame_size = 0;
+  std::vector<uint8_t> out_buf;
 };
 
 typedef cereal::Sentinel::SentinelType SentinelType;
 
+// appended to the directory of a segment until logging to it starts
+const std::string PREPARED_SEGMENT_SUFFIX = ".tmp";
+
+struct LogSegmentFiles {
+  std::string path;
+  std::unique_ptr<RawFile> rlog, qlog;
+  std::string lock_file;  // removed once the files are closed
+};
+
+// Decouples disk writes from the loggerd poll loop.
+// write() copies the message into a single-producer single-consumer ring, a writer thread
+// writes the messages straight out of the ring with one gather write per file.
+class AsyncLogWriter {
+public:
+  struct Stats {
+    uint64_t bytes_written = 0;       // bytes on disk, after compression
+    uint64_t bytes_in = 0;            // bytes of log data, before compression
+    uint64_t writes = 0;
+    uint64_t stalls = 0;              // times write() had to wait for free space
+    size_t queue_bytes = 0;
+    size_t max_queue_bytes = 0;
+    double max_write_ms = 0;
+    // write latency histogram, bucket i counts writes that took [2^i, 2^(i+1)) us
+    std::array<uint32_t, 20> write_latency_hist = {};
+  };
+
+  AsyncLogWriter(size_t capacity = 32 * 1024 * 1024);
+  ~AsyncLogWriter();
+  void write(const uint8_t *data, size_t size, bool in_qlog);
+  // serializes the message directly into the ring
+  void write(MessageBuilder &msg, bool in_qlog);
+  // close the current files and continue with these, in order with write()
+  void setFiles(std::unique_ptr<LogSegmentFiles> files);
+  Stats stats();
+
+private:
+  enum RecordType : uint32_t { RLOG, RLOG_AND_QLOG, LARGE_RLOG, LARGE_RLOG_AND_QLOG, SET_FILES, PADDING };
+  struct RecordHeader {
+    uint32_t type;
+    uint32_t size;
+  };
+  // a gather write is issued once this much data or this many messages are pending
+  static constexpr size_t BLOCK_SIZE = 512 * 1024;
+  static constexpr int MAX_IOVS = 1024;
+  // compressed data is flushed to disk at this interval
+  static constexpr double COMPRESSED_FLUSH_INTERVAL_MS = 1000;
+
+  inline bool isLarge(size_t size) const { return size + sizeof(RecordHeader) > capacity / 4; }
+  uint8_t *reserve(RecordType type, size_t size);
+  void commit();
+  void push(RecordType type, const void *data, size_t size);
+  void writerThread();
+  void writePending();
+  void writeFile(RawFile *file, std::vector<struct iovec> &iovs);
+  void flushFiles();
+  void addWriteStats(double start_ms, size_t size_in, size_t size_out);
+  void closeFiles();
+
+  const size_t capacity;
+  std::unique_ptr<uint8_t[]> ring;
+  std::atomic<size_t> head = 0;  // total bytes pushed, only advanced by the producer
+  std::atomic<size_t> tail = 0;  // total bytes consumed, only advanced by the writer thread
+  size_t reserved_head = 0;      // only accessed by the producer
+  std::atomic<bool> exit = false;
+  std::mutex lock;
+  std::condition_variable cv;
+
+  // only accessed in the writer thread
+  std::unique_ptr<LogSegmentFiles> files;
+  std::vector<struct iovec> rlog_iovs, qlog_iovs;  // point into the ring or into large_msgs
+  std::vector<std::unique_ptr<std::string>> large_msgs;
+  size_t pending_bytes = 0;
+  double last_flush_ms = 0;
+
+  std::mutex stats_lock;
+  Stats stats_;
+  std::thread thread;
+};
+
 
 class LoggerState {
 public:
-  LoggerState(const std::string& log_root = Path::log_root());
+  // zstd_level > 0 writes rlog.zst and qlog.zst, compressed on the writer thread
+  LoggerState(const std::string& log_root = Path::log_root(), int zstd_level = 0);
   ~LoggerState();
   bool next();
   void write(uint8_t* data, size_t size, bool in_qlog);
+  inline void write(MessageBuilder &msg, bool in_qlog) { writer.write(msg, in_qlog); }
   inline int segment() const { return part; }
   inline const std::string& segmentPath() const { return segment_path; }
   inline const std::string& routeName() const { return route_name; }
   inline void write(kj::ArrayPtr<kj::byte> bytes, bool in_qlog) { write(bytes.begin(), bytes.size(), in_qlog); }
   inline void setExitSignal(int signal) { exit_signal = signal; }
+  inline AsyncLogWriter::Stats writerStats() { return writer.stats(); }
 
 protected:
+  std::unique_ptr<LogSegmentFiles> prepareSegment(int segment);
+
   int part = -1, exit_signal = 0;
-  std::string route_path, route_name, segment_path, lock_file;
+  const int zstd_level;
+  std::string route_path, route_name, segment_path;
   kj::Array<capnp::word> init_data;
-  std::unique_ptr<RawFile> rlog, qlog;
+  // the next segment is set up on a helper thread while the current one is logged
+  std::future<std::unique_ptr<LogSegmentFiles>> next_segment;
+  AsyncLogWriter writer;
 };
 
 kj::Array<capnp::word> logger_build_init_data();
@@ -1,6 +1,8 @@
 #include <sys/xattr.h>
 
+#include <algorithm>
 #include <map>
+#include <numeric>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -14,18 +16,40 @@
 ExitHandler do_exit;
 
 struct LoggerdState {
-  LoggerState logger;
+  LoggerState logger{Path::log_root(), LOGGERD_ZSTD_LEVEL};
   std::atomic<double> last_camera_seen_tms{0.0};
   std::atomic<int> ready_to_rotate{0};  // count of encoders ready to rotate
   int max_waiting = 0;
   double last_rotate_tms = 0.;      // last rotate time in ms
+  double rotation_time_ms = 0.;     // time taken by the last rotation
+};
+
+struct ServiceState {
+  std::string name;
+  int counter, freq;
+  bool encoder, user_flag;
+  // deficit round robin, a service may write its quantum of bytes per round
+  int frequency;
+  double avg_size = 1024;
+  int64_t deficit = 0;
+  bool backlogged = false;
+  // counters, reset when the stats are published
+  uint32_t msg_count = 0, qlog_msg_count = 0, deferred = 0;
+  uint64_t bytes_count = 0, qlog_bytes_count = 0;
+
+  inline int64_t quantum() const {
+    // at least one message, and about the expected bytes per round for the busy services
+    return std::max(avg_size, frequency * avg_size / DRR_ROUNDS_PER_SEC);
+  }
 };
 
 void logger_rotate(LoggerdState *s) {
+  double start_tms = millis_since_boot();
   bool ret =s->logger.next();
   assert(ret);
   s->ready_to_rotate = 0;
   s->last_rotate_tms = millis_since_boot();
+  s->rotation_time_ms = s->last_rotate_tms - start_tms;
   LOGW((s->logger.segment() == 0) ? "logging to %s" : "rotated to %s", s->logger.segmentPath().c_str());
 }
 
@@ -59,6 +83,8 @@ struct RemoteEncoder {
   int current_segment = -1;
   std::vector<Message *> q;
   int dropped_frames = 0;
+  uint32_t last_encode_id = 0;
+  uint64_t missed_packets = 0;  // gaps in encodeId, packets that never reached loggerd
   bool recording = false;
   bool marked_ready_to_rotate = false;
   bool seen_first_packet = false;
@@ -74,6 +100,11 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
   auto idx = edata.getIdx();
   auto flags = idx.getFlags();
 
+  if (re.seen_first_packet && idx.getEncodeId() > re.last_encode_id + 1) {
+    re.missed_packets += idx.getEncodeId() - re.last_encode_id - 1;
+  }
+  re.last_encode_id = std::max(re.last_encode_id, idx.getEncodeId());
+
   // encoderd can have started long before loggerd
   if (!re.seen_first_packet) {
     re.seen_first_packet = true;
@@ -145,9 +176,8 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
     auto evt = bmsg.initEvent(event.getValid());
     evt.setLogMonoTime(event.getLogMonoTime());
     (evt.*(encoder_info.set_encode_idx_func))(idx);
-    auto new_msg = bmsg.toBytes();
-    s->logger.write((uint8_t *)new_msg.begin(), new_msg.size(), true);   // always in qlog?
-    bytes_count += new_msg.size();
+    bytes_count += bmsg.getSerializedSize();
+    s->logger.write(bmsg, true);   // always in qlog?
 
     // free the message, we used it
     delete msg;
@@ -197,13 +227,70 @@ void handle_user_flag(LoggerdState *s) {
   prev_segment = s->logger.segment();
 }
 
+// upper bound of the histogram bucket holding the p-th percentile, in ms
+float latency_percentile(const std::array<uint32_t, 20> &hist, float p) {
+  uint64_t total = std::accumulate(hist.begin(), hist.end(), uint64_t{0});
+  uint64_t count = 0;
+  for (int i = 0; i < hist.size(); ++i) {
+    count += hist[i];
+    if (total > 0 && count >= total * p) return (2 << i) / 1000.0;
+  }
+  return 0;
+}
+
+void publish_stats(PubMaster &pm, LoggerdState *s, std::unordered_map<SubSocket*, ServiceState> &service_state,
+                   std::unordered_map<SubSocket*, struct RemoteEncoder> &remote_encoders, double seconds) {
+  static AsyncLogWriter::Stats prev;
+  const auto stats = s->logger.writerStats();
+  std::array<uint32_t, 20> hist;
+  for (int i = 0; i < hist.size(); ++i) {
+    hist[i] = stats.write_latency_hist[i] - prev.write_latency_hist[i];
+  }
+
+  MessageBuilder msg;
+  auto ls = msg.initEvent().initLoggerdStats();
+  ls.setIntervalSeconds(seconds);
+  ls.setSegmentNum(s->logger.segment());
+  ls.setRotationTimeMs(s->rotation_time_ms);
+  ls.setBytesLogged(stats.bytes_in - prev.bytes_in);
+  ls.setBytesWritten(stats.bytes_written - prev.bytes_written);
+  ls.setWrites(stats.writes - prev.writes);
+  ls.setStalls(stats.stalls - prev.stalls);
+  ls.setQueueBytes(stats.queue_bytes);
+  ls.setWriteLatencyP50Ms(latency_percentile(hist, 0.5));
+  ls.setWriteLatencyP90Ms(latency_percentile(hist, 0.9));
+  ls.setWriteLatencyP99Ms(latency_percentile(hist, 0.99));
+  ls.setWriteLatencyMaxMs(latency_percentile(hist, 1.0));
+  prev = stats;
+
+  int active = std::count_if(service_state.begin(), service_state.end(), [](auto &it) { return it.second.msg_count > 0; });
+  auto services = ls.initServices(active);
+  int i = 0;
+  for (auto &[sock, service] : service_state) {
+    if (service.msg_count == 0) continue;
+
+    auto ss = services[i++];
+    ss.setName(service.name);
+    ss.setMsgsPerSecond(service.msg_count / seconds);
+    ss.setBytesPerSecond(service.bytes_count / seconds);
+    ss.setMsgCount(service.msg_count);
+    ss.setBytes(service.bytes_count);
+    ss.setQlogMsgCount(service.qlog_msg_count);
+    ss.setQlogBytes(service.qlog_bytes_count);
+    ss.setDeferredRounds(service.deferred);
+    if (service.encoder) {
+      auto &re = remote_encoders[sock];
+      ss.setMissedPackets(re.missed_packets);
+      re.missed_packets = 0;
+    }
+    service.msg_count = service.qlog_msg_count = service.deferred = 0;
+    service.bytes_count = service.qlog_bytes_count = 0;
+  }
+  pm.send("loggerdStats", msg);
+}
+
 void loggerd_thread() {
   // setup messaging
-  typedef struct ServiceState {
-    std::string name;
-    int counter, freq;
-    bool encoder, user_flag;
-  } ServiceState;
   std::unordered_map<SubSocket*, ServiceState> service_state;
   std::unordered_map<SubSocket*, struct RemoteEncoder> remote_encoders;
 
@@ -226,8 +313,10 @@ void loggerd_thread() {
       .freq = it.decimation,
       .encoder = encoder,
       .user_flag = it.name == "userFlag",
+      .frequency = it.frequency,
     };
   }
+  PubMaster pm({"loggerdStats"});
 
   LoggerdState s;
   // init logger
@@ -244,27 +333,52 @@ void loggerd_thread() {
 
   uint64_t msg_count = 0, bytes_count = 0;
   double start_ts = millis_since_boot();
+  double last_stats_ts = start_ts;
+  std::vector<SubSocket *> backlog;  // sockets with pending messages, in round robin order
   while (!do_exit) {
-    // poll for new messages on all sockets
-    for (auto sock : poller->poll(1000)) {
-      if (do_exit) break;
-
+    // only block if all sockets are drained
+    for (auto sock : poller->poll(backlog.empty() ? 1000 : 0)) {
       ServiceState &service = service_state[sock];
-      if (service.user_flag) {
-        handle_user_flag(&s);
+      if (!service.backlogged) {
+        service.backlogged = true;
+        backlog.push_back(sock);
       }
+    }
+
+    // one round over the backlogged sockets, a burst on one service can't starve the others
+    for (auto it = backlog.begin(); it != backlog.end() && !do_exit;) {
+      SubSocket *sock = *it;
+      ServiceState &service = service_state[sock];
+      service.deficit += service.quantum();
+
+      bool drained = false;
+      while (service.deficit > 0 && !do_exit) {
+        Message *msg = sock->receive(true);
+        if (!msg) {
+          drained = true;
+          break;
+        }
+        if (service.user_flag) {
+          handle_user_flag(&s);
+        }
 
-      // drain socket
-      int count = 0;
-      Message *msg = nullptr;
-      while (!do_exit && (msg = sock->receive(true))) {
+        const size_t size = msg->getSize();
+        service.deficit -= size;
+        service.avg_size += (size - service.avg_size) * 0.01;
         const bool in_qlog = service.freq != -1 && (service.counter++ % service.freq == 0);
+        service.msg_count++;
+        service.bytes_count += size;
+        if (in_qlog) {
+          service.qlog_msg_count++;
+          service.qlog_bytes_count += size;
+        }
+
         if (service.encoder) {
           s.last_camera_seen_tms = millis_since_boot();
           bytes_count += handle_encoder_msg(&s, msg, service.name, remote_encoders[sock], encoder_infos_dict[service.name]);
         } else {
-          s.logger.write((uint8_t *)msg->getData(), msg->getSize(), in_qlog);
-          bytes_count += msg->getSize();
+          s.logger.write((uint8_t *)msg->getData(), size, in_qlog);
+          bytes_count += size;
           delete msg;
         }
 
@@ -273,15 +387,29 @@ void loggerd_thread() {
         if ((++msg_count % 1000) == 0) {
           double seconds = (millis_since_boot() - start_ts) / 1000.0;
           LOGD("%" PRIu64 " messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, bytes_count * 0.001 / seconds);
+          auto stats = s.logger.writerStats();
+          LOGD("writer: queue %zu KB (max %zu KB), %" PRIu64 " writes, max write %.2f ms, %" PRIu64 " stalls, ratio %.2f",
+               stats.queue_bytes / 1024, stats.max_queue_bytes / 1024, stats.writes, stats.max_write_ms, stats.stalls,
+               stats.bytes_written > 0 ? (double)stats.bytes_in / stats.bytes_written : 1.0);
         }
+      }
 
-        count++;
-        if (count >= 200) {
-          LOGD("large volume of '%s' messages", service.name.c_str());
-          break;
-        }
+      if (drained) {
+        // drained, an idle service doesn't keep its credit
+        service.deficit = 0;
+        service.backlogged = false;
+        it = backlog.erase(it);
+      } else {
+        ++service.deferred;
+        ++it;
       }
     }
+
+    const double tms = millis_since_boot();
+    if (tms - last_stats_ts >= 1000) {
+      publish_stats(pm, &s, service_state, remote_encoders, (tms - last_stats_ts) / 1000.0);
+      last_stats_ts = tms;
+    }
   }
 
   LOGW("closing logger");
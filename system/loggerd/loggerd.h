@@ -19,6 +19,9 @@ const int LIVESTREAM_BITRATE = 1e6;
 const int QCAM_BITRATE = 256000;
 
 #define NO_CAMERA_PATIENCE 500  // fall back to time-based rotation if all cameras are dead
+// loggerd drains the sockets in deficit round robin rounds, a service may write
+// about 1/DRR_ROUNDS_PER_SEC of its expected bytes per second in a round
+#define DRR_ROUNDS_PER_SEC 100
 
 #define INIT_ENCODE_FUNCTIONS(encode_type)                                \
   .get_encode_data_func = &cereal::Event::Reader::get##encode_type##Data, \
@@ -26,7 +29,11 @@ const int QCAM_BITRATE = 256000;
   .init_encode_data_func = &cereal::Event::Builder::init##encode_type##Data
 
 const bool LOGGERD_TEST = getenv("LOGGERD_TEST");
+// on PC, encode with libx265/libx264 like the device instead of lossless FFVHUFF
+const bool ENCODERD_SOFTWARE = getenv("ENCODERD_SOFTWARE");
 const int SEGMENT_LENGTH = LOGGERD_TEST ? atoi(getenv("LOGGERD_SEGMENT_LENGTH")) : 60;
+// opt-in online compression of rlog and qlog, e.g. LOGGERD_ZSTD_LEVEL=3
+const int LOGGERD_ZSTD_LEVEL = util::getenv("LOGGERD_ZSTD_LEVEL", 0);
 
 constexpr char PRESERVE_ATTR_NAME[] = "user.preserve";
 constexpr char PRESERVE_ATTR_VALUE = '1';
@@ -40,7 +47,7 @@ public:
   int frame_height = -1;
   int fps = MAIN_FPS;
   int bitrate = MAIN_BITRATE;
-  cereal::EncodeIndex::Type encode_type = Hardware::PC() ? cereal::EncodeIndex::Type::BIG_BOX_LOSSLESS
+  cereal::EncodeIndex::Type encode_type = Hardware::PC() && !ENCODERD_SOFTWARE ? cereal::EncodeIndex::Type::BIG_BOX_LOSSLESS
                                                          : cereal::EncodeIndex::Type::FULL_H_E_V_C;
   ::cereal::EncodeData::Reader (cereal::Event::Reader::*get_encode_data_func)() const;
   void (cereal::Event::Builder::*set_encode_idx_func)(::cereal::EncodeIndex::Reader);
@@ -0,0 +1,76 @@
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common/timing.h"
+#include "system/loggerd/logger.h"
+
+// Measures the cost of logging through LoggerState: write syscalls per second and CPU time per MB logged.
+// usage: logger_benchmark [MB to log] [zstd level]
+
+static uint64_t write_syscalls() {
+  std::ifstream io("/proc/self/io");
+  std::string key;
+  uint64_t value = 0;
+  while (io >> key >> value) {
+    if (key == "syscw:") return value;
+  }
+  return 0;
+}
+
+static double cpu_ms() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+  const size_t total_mb = argc > 1 ? std::stoul(argv[1]) : 512;
+  const int zstd_level = argc > 2 ? std::stoi(argv[2]) : 0;
+  const std::string log_root = "/tmp/logger_benchmark";
+  system(("rm " + log_root + " -rf").c_str());
+
+  // a mix of message sizes similar to a drive: mostly small messages with some large ones
+  std::mt19937 rng(0);
+  std::vector<std::string> msgs(4096);
+  for (int i = 0; i < msgs.size(); ++i) {
+    size_t size = i % 100 == 0 ? 50000 : (i % 5 == 0 ? 1000 : 100);
+    msgs[i].resize(size);
+    for (size_t j = 0; j < size; ++j) {
+      msgs[i][j] = j % 8 < 4 ? j & 0xff : rng() % 16;
+    }
+  }
+
+  uint64_t logged = 0;
+  double start_ms, start_cpu_ms;
+  uint64_t start_syscalls;
+  {
+    LoggerState logger(log_root, zstd_level);
+    logger.next();
+    start_ms = millis_since_boot();
+    start_cpu_ms = cpu_ms();
+    start_syscalls = write_syscalls();
+
+    for (size_t i = 0; logged < total_mb * 1024 * 1024; ++i) {
+      auto &msg = msgs[i % msgs.size()];
+      logger.write((uint8_t *)msg.data(), msg.size(), i % 10 == 0);
+      logged += msg.size();
+      if (i % 100000 == 0 && i > 0) logger.next();
+    }
+    // the destructor waits for the writer to finish
+  }
+  const double seconds = (millis_since_boot() - start_ms) / 1000.0;
+  const double mb = logged / (1024.0 * 1024.0);
+  const uint64_t syscalls = write_syscalls() - start_syscalls;
+
+  printf("logged %.1f MB in %.2f s (%.1f MB/s), zstd level %d\n", mb, seconds, mb / seconds, zstd_level);
+  printf("write syscalls: %" PRIu64 ", %.1f/s, %.2f KB per syscall\n", syscalls, syscalls / seconds, logged / 1024.0 / std::max<uint64_t>(syscalls, 1));
+  printf("cpu: %.2f ms per MB\n", (cpu_ms() - start_cpu_ms) / mb);
+  return 0;
+}
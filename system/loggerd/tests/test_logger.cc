@@ -1,17 +1,40 @@
+#include <zstd.h>
+
 #include "catch2/catch.hpp"
 #include "system/loggerd/logger.h"
 
 typedef cereal::Sentinel::SentinelType SentinelType;
 
-void verify_segment(const std::string &route_path, int segment, int max_segment, int required_event_cnt) {
+std::string read_log(const std::string &log_file, bool compressed) {
+  std::string log = util::read_file(log_file);
+  if (!compressed) return log;
+
+  std::string out;
+  std::string buf(ZSTD_DStreamOutSize(), '\0');
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  ZSTD_inBuffer input = {log.data(), log.size(), 0};
+  size_t ret = 0;
+  while (input.pos < input.size) {
+    ZSTD_outBuffer output = {buf.data(), buf.size(), 0};
+    ret = ZSTD_decompressStream(dctx, &output, &input);
+    REQUIRE(!ZSTD_isError(ret));
+    out.append(buf.data(), output.pos);
+  }
+  ZSTD_freeDCtx(dctx);
+  // the last frame must be complete
+  REQUIRE(ret == 0);
+  return out;
+}
+
+void verify_segment(const std::string &route_path, int segment, int max_segment, int required_event_cnt, bool compressed = false) {
   const std::string segment_path = route_path + "--" + std::to_string(segment);
   SentinelType begin_sentinel = segment == 0 ? SentinelType::START_OF_ROUTE : SentinelType::START_OF_SEGMENT;
   SentinelType end_sentinel = segment == max_segment - 1 ? SentinelType::END_OF_ROUTE : SentinelType::END_OF_SEGMENT;
 
   REQUIRE(!util::file_exists(segment_path + "/rlog.lock"));
   for (const char *fn : {"/rlog", "/qlog"}) {
-    const std::string log_file = segment_path + fn;
-    std::string log = util::read_file(log_file);
+    const std::string log_file = segment_path + fn + (compressed ? ".zst" : "");
+    std::string log = read_log(log_file, compressed);
     REQUIRE(!log.empty());
     int event_cnt = 0, i = 0;
     kj::ArrayPtr<const capnp::word> words((capnp::word *)log.data(), log.size() / sizeof(capnp::word));
@@ -64,6 +87,8 @@ TEST_CASE("logger") {
       REQUIRE(logger.next());
       REQUIRE(util::file_exists(logger.segmentPath() + "/rlog.lock"));
       REQUIRE(logger.segment() == i);
+      // the next segment only gets its name when logging to it starts
+      REQUIRE(!util::file_exists(log_root + "/" + route_name + "--" + std::to_string(i + 1)));
       write_msg(&logger);
     }
     logger.setExitSignal(1);
@@ -71,4 +96,35 @@ TEST_CASE("logger") {
   for (int i = 0; i < segment_cnt; ++i) {
     verify_segment(log_root + "/" + route_name, i, segment_cnt, 1);
   }
+  // the segment prepared ahead is removed
+  REQUIRE(!util::file_exists(log_root + "/" + route_name + "--" + std::to_string(segment_cnt)));
+  REQUIRE(!util::file_exists(log_root + "/" + route_name + "--" + std::to_string(segment_cnt) + PREPARED_SEGMENT_SUFFIX));
+}
+
+TEST_CASE("logger zstd") {
+  const int segment_cnt = 3;
+  const int msg_cnt = 100000;
+  const std::string log_root = "/tmp/test_logger_zstd";
+  system(("rm " + log_root + " -rf").c_str());
+  std::string route_name;
+  {
+    LoggerState logger(log_root, 3);
+    route_name = logger.routeName();
+    for (int i = 0; i < segment_cnt; ++i) {
+      REQUIRE(logger.next());
+      REQUIRE(util::file_exists(logger.segmentPath() + "/rlog.lock"));
+      // enough data to span multiple zstd frames
+      for (int j = 0; j < msg_cnt; ++j) {
+        write_msg(&logger);
+      }
+    }
+    logger.setExitSignal(1);
+  }
+  for (int i = 0; i < segment_cnt; ++i) {
+    const std::string segment_path = log_root + "/" + route_name + "--" + std::to_string(i);
+    REQUIRE(!util::file_exists(segment_path + "/rlog"));
+    const std::string rlog = util::read_file(segment_path + "/rlog.zst");
+    REQUIRE(rlog.size() < read_log(segment_path + "/rlog.zst", true).size() / 2);
+    verify_segment(log_root + "/" + route_name, i, segment_cnt, msg_cnt, true);
+  }
 }
@@ -163,6 +163,17 @@ class TestUploader(UploaderTestCase):
       uploaded = UPLOAD_ATTR_NAME in os.listxattr(fn) and os.getxattr(fn, UPLOAD_ATTR_NAME) == UPLOAD_ATTR_VALUE
       assert not uploaded, "File upload when locked"
 
+  def test_no_upload_prepared_segment(self):
+    # a segment loggerd prepared ahead, left behind by a crash with its lock already cleared
+    for t in ["qlog", "rlog"]:
+      self.make_file_with_data(self.seg_dir + ".tmp", t, 1)
+
+    self.start_thread()
+    time.sleep(5)
+    self.join_thread()
+
+    assert len(log_handler.upload_order) == 0, "Prepared segment uploaded"
+
   def test_no_upload_with_xattr(self):
     self.gen_files(lock=False, xattr=UPLOAD_ATTR_VALUE)
 
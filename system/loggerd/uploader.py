@@ -96,7 +96,8 @@ class Uploader:
       except OSError:
         continue
 
-      if any(name.endswith(".lock") for name in names):
+      # locked, or prepared by loggerd and never logged to
+      if logdir.endswith(".tmp") or any(name.endswith(".lock") for name in names):
         continue
 
       for name in sorted(names, key=lambda n: self.immediate_priority.get(n, 1000)):
@@ -1,5 +1,10 @@
 #pragma clang diagnostic ignored "-Wdeprecated-declarations"
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
 #include "system/loggerd/video_writer.h"
 #include "common/swaglog.h"
@@ -45,21 +50,100 @@ VideoWriter::VideoWriter(const char *path, const char *filename, bool remuxing,
     assert(err >= 0);
 
   } else {
-    this->of = util::safe_fopen(this->vid_path.c_str(), "wb");
-    assert(this->of);
+    this->fd = HANDLE_EINTR(open(this->vid_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664));
+    assert(this->fd >= 0);
+    // page aligned, so the buffered writes are whole pages
+    this->raw_buf.reset((uint8_t *)aligned_alloc(4096, BUFFER_SIZE));
+    assert(this->raw_buf);
   }
+
+  thread = std::thread(&VideoWriter::writerThread, this);
 }
 
 void VideoWriter::write(uint8_t *data, int len, long long timestamp, bool codecconfig, bool keyframe) {
-  if (of && data) {
-    size_t written = util::safe_fwrite(data, 1, len, of);
-    if (written != len) {
+  Packet pkt = {.timestamp = timestamp, .codecconfig = codecconfig, .keyframe = keyframe};
+  if (data && len > 0) {
+    pkt.data.assign(data, data + len);
+  }
+  {
+    std::lock_guard lk(lock);
+    // the codec config is always written, other packets are dropped while the queue
+    // is full, up to a keyframe the video can continue from
+    if (!codecconfig) {
+      const bool full = queue_bytes + len > MAX_QUEUE_BYTES;
+      if (dropping && keyframe && !full) {
+        LOGW("%s: write queue caught up, dropped %u packets", vid_path.c_str(), dropped);
+        dropping = false;
+        dropped = 0;
+      } else if (!dropping && full) {
+        LOGE("%s: write queue full, dropping packets up to the next keyframe", vid_path.c_str());
+        dropping = true;
+      }
+      if (dropping) {
+        ++dropped;
+        return;
+      }
+    }
+    queue_bytes += pkt.data.size();
+    queue.push_back(std::move(pkt));
+  }
+  cv.notify_one();
+}
+
+void VideoWriter::writerThread() {
+  util::set_thread_name("video_writer");
+
+  while (true) {
+    Packet pkt;
+    {
+      std::unique_lock lk(lock);
+      cv.wait(lk, [this]() { return exit || !queue.empty(); });
+      if (queue.empty()) break;
+      pkt = std::move(queue.front());
+      queue.pop_front();
+    }
+
+    writePacket(pkt);
+    std::lock_guard lk(lock);
+    queue_bytes -= pkt.data.size();
+  }
+}
+
+void VideoWriter::writeRaw(const uint8_t *data, size_t len) {
+  while (len > 0) {
+    size_t n = std::min(len, BUFFER_SIZE - raw_buf_len);
+    memcpy(raw_buf.get() + raw_buf_len, data, n);
+    raw_buf_len += n;
+    data += n;
+    len -= n;
+    if (raw_buf_len == BUFFER_SIZE) flushRaw();
+  }
+}
+
+void VideoWriter::flushRaw() {
+  size_t written = 0;
+  while (written < raw_buf_len) {
+    ssize_t n = HANDLE_EINTR(::write(fd, raw_buf.get() + written, raw_buf_len - written));
+    if (n < 0) {
       LOGE("failed to write file.errno=%d", errno);
+      break;
     }
+    written += n;
+  }
+  raw_buf_len = 0;
+}
+
+void VideoWriter::writePacket(const Packet &packet) {
+  uint8_t *data = (uint8_t *)packet.data.data();
+  const int len = packet.data.size();
+  const long long timestamp = packet.timestamp;
+
+  if (fd >= 0 && len > 0) {
+    writeRaw(data, len);
   }
 
   if (remuxing) {
-    if (codecconfig) {
+    if (packet.codecconfig) {
       if (len > 0) {
         codec_ctx->extradata = (uint8_t*)av_mallocz(len + AV_INPUT_BUFFER_PADDING_SIZE);
         codec_ctx->extradata_size = len;
@@ -82,7 +166,7 @@ void VideoWriter::write(uint8_t *data, int len, long long timestamp, bool codecc
       pkt.pts = pkt.dts = av_rescale_q_rnd(timestamp, in_timebase, ofmt_ctx->streams[0]->time_base, rnd);
       pkt.duration = av_rescale_q(50*1000, in_timebase, ofmt_ctx->streams[0]->time_base);
 
-      if (keyframe) {
+      if (packet.keyframe) {
         pkt.flags |= AV_PKT_FLAG_KEY;
       }
 
@@ -96,6 +180,15 @@ void VideoWriter::write(uint8_t *data, int len, long long timestamp, bool codecc
 }
 
 VideoWriter::~VideoWriter() {
+  // the writer thread drains the queue before it exits, which takes as long
+  // as writing at most MAX_QUEUE_BYTES
+  {
+    std::lock_guard lk(lock);
+    exit = true;
+  }
+  cv.notify_one();
+  thread.join();
+
   if (this->remuxing) {
     int err = av_write_trailer(this->ofmt_ctx);
     if (err != 0) LOGE("av_write_trailer failed %d", err);
@@ -104,9 +197,12 @@ VideoWriter::~VideoWriter() {
     if (err != 0) LOGE("avio_closep failed %d", err);
     avformat_free_context(this->ofmt_ctx);
   } else {
-    util::safe_fflush(this->of);
-    fclose(this->of);
-    this->of = nullptr;
+    flushRaw();
+    close(this->fd);
+    this->fd = -1;
+  }
+  if (dropped > 0) {
+    LOGW("%s: closed while dropping, dropped %u packets", vid_path.c_str(), dropped);
   }
   unlink(this->lock_path.c_str());
 }
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -9,17 +15,46 @@ extern "C" {
 
 #include "cereal/messaging/messaging.h"
 
+// Packets are copied into a queue and written on a thread of their own,
+// raw video is collected in a large aligned buffer before it is written out.
+// When the disk stalls and the queue is full, packets are dropped up to the next keyframe.
 class VideoWriter {
 public:
   VideoWriter(const char *path, const char *filename, bool remuxing, int width, int height, int fps, cereal::EncodeIndex::Type codec);
   void write(uint8_t *data, int len, long long timestamp, bool codecconfig, bool keyframe);
+  // writes out everything that is queued before the file is closed
   ~VideoWriter();
 private:
+  struct Packet {
+    std::vector<uint8_t> data;
+    long long timestamp;
+    bool codecconfig, keyframe;
+  };
+  static constexpr size_t BUFFER_SIZE = 2 * 1024 * 1024;
+  // about 20 seconds of the road camera stream
+  static constexpr size_t MAX_QUEUE_BYTES = 32 * 1024 * 1024;
+
+  void writerThread();
+  void writePacket(const Packet &pkt);
+  void writeRaw(const uint8_t *data, size_t len);
+  void flushRaw();
+
   std::string vid_path, lock_path;
-  FILE *of = nullptr;
+  int fd = -1;
+  std::unique_ptr<uint8_t, decltype(&free)> raw_buf{nullptr, free};
+  size_t raw_buf_len = 0;
 
   AVCodecContext *codec_ctx;
   AVFormatContext *ofmt_ctx;
   AVStream *out_stream;
   bool remuxing;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<Packet> queue;
+  size_t queue_bytes = 0;  // until the packets are written
+  bool dropping = false;
+  uint32_t dropped = 0;
+  bool exit = false;
+  std::thread thread;
 };
@@ -30,7 +30,7 @@ int main(int argc, char *argv[]) {
   cmd_parser.addOption({"panda", "read can messages from panda"});
   cmd_parser.addOption({"panda-serial", "read can messages from panda with given serial", "panda-serial"});
   if (SocketCanStream::available()) {
-    cmd_parser.addOption({"socketcan", "read can messages from given SocketCAN device", "socketcan"});
+    cmd_parser.addOption({"socketcan", "read can messages from given SocketCAN devices (comma separated, one bus each)", "socketcan"});
   }
   cmd_parser.addOption({"zmq", "the ip address on which to receive zmq messages", "zmq"});
   cmd_parser.addOption({"data_dir", "local directory with routes", "data_dir"});
@@ -50,7 +50,7 @@ int main(int argc, char *argv[]) {
       return 0;
     }
   } else if (cmd_parser.isSet("socketcan")) {
-    stream = new SocketCanStream(&app, {.device = cmd_parser.value("socketcan")});
+    stream = new SocketCanStream(&app, {.devices = cmd_parser.value("socketcan").split(',', QString::SkipEmptyParts)});
   } else {
     uint32_t replay_flags = REPLAY_FLAG_NONE;
     if (cmd_parser.isSet("ecam")) replay_flags |= REPLAY_FLAG_ECAM;
@@ -0,0 +1,373 @@
+#include <algorithm>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QEventLoop>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QProcess>
+#include <QTemporaryFile>
+#include <QTextStream>
+#include <QThread>
+
+#include "tools/cabana/streams/abstractstream.h"
+#include "tools/replay/route.h"
+
+// Headless batch analysis over local or remote routes.
+// Every route is processed by its own worker process, the output is printed in route order.
+
+enum class Job { Decode, Export, Search };
+
+struct CliOptions {
+  Job job = Job::Decode;
+  bool json = false;
+  QString data_dir;
+  SourceSet buses;
+  std::set<uint32_t> addresses;
+  // search
+  double value = 0;
+  int min_size = 8;
+  int max_size = 8;
+  bool little_endian = true;
+  bool is_signed = false;
+};
+
+// Loads all CAN events of a route at once, the same way ReplayStream merges loaded segments.
+class RouteStream : public AbstractStream {
+public:
+  RouteStream(QObject *parent) : AbstractStream(parent) {}
+  void start() override {}
+  bool liveStreaming() const override { return false; }
+  QString routeName() const override { return route_name; }
+  uint64_t beginMonoTime() const override { return begin_mono_time; }
+  double maxSeconds() const override { return all_events_.empty() ? 0 : toSeconds(all_events_.back()->mono_time); }
+
+  bool loadRoute(const QString &route_str, const QString &data_dir) {
+    Route route(route_str, data_dir);
+    if (!route.load()) {
+      qWarning() << "failed to load route" << route_str;
+      return false;
+    }
+    route_name = route.name();
+
+    std::vector<bool> filters(cereal::Event::Which::CAN + 1, false);
+    filters[cereal::Event::Which::CAN] = true;
+    std::vector<const CanEvent *> new_events;
+    for (const auto &[n, files] : route.segments()) {
+      const QString &log_file = files.rlog.isEmpty() ? files.qlog : files.rlog;
+      LogReader log(filters);
+      if (log_file.isEmpty() || !log.load(log_file.toStdString(), nullptr, true)) {
+        qWarning() << "failed to load segment" << n << "of" << route_name;
+        continue;
+      }
+      for (const Event &e : log.events) {
+        capnp::FlatArrayMessageReader reader(e.data);
+        for (const auto &c : reader.getRoot<cereal::Event>().getCan()) {
+          new_events.push_back(newEvent(e.mono_time, c));
+        }
+      }
+    }
+    if (new_events.empty()) return false;
+
+    std::stable_sort(new_events.begin(), new_events.end(), [](auto l, auto r) { return l->mono_time < r->mono_time; });
+    begin_mono_time = new_events.front()->mono_time;
+    mergeEvents(new_events);
+    for (auto e : new_events) sources.insert(e->src);
+    // Update last messages to the end of the route
+    emit seekedTo(maxSeconds());
+    return true;
+  }
+
+private:
+  QString route_name;
+  uint64_t begin_mono_time = 0;
+};
+
+static bool selected(const CliOptions &opts, const MessageId &id) {
+  return (opts.buses.empty() || opts.buses.count(id.source)) &&
+         (opts.addresses.empty() || opts.addresses.count(id.address));
+}
+
+static void writeRow(QTextStream &out, const CliOptions &opts, const QJsonObject &row, const QStringList &columns) {
+  if (opts.json) {
+    out << QJsonDocument(row).toJson(QJsonDocument::Compact) << "\n";
+  } else {
+    QStringList values;
+    for (const auto &c : columns) values.push_back(row[c].toVariant().toString());
+    out << values.join(",") << "\n";
+  }
+}
+
+static QStringList csvColumns(Job job) {
+  switch (job) {
+    case Job::Decode: return {"route", "time", "bus", "address", "message", "signal", "value"};
+    case Job::Export: return {"route", "time", "addr", "bus", "data"};
+    case Job::Search: return {"route", "bus", "address", "start_bit", "size", "time"};
+  }
+  return {};
+}
+
+static void decode(QTextStream &out, const CliOptions &opts) {
+  const QStringList columns = csvColumns(Job::Decode);
+
+  for (const auto &[id, _] : can->lastMessages()) {
+    auto msg = dbc()->msg(id);
+    if (!msg || msg->sigs.empty() || !selected(opts, id)) continue;
+
+    for (auto e : can->events(id)) {
+      QJsonObject row{{"route", can->routeName()},
+                      {"time", can->toSeconds(e->mono_time)},
+                      {"bus", e->src},
+                      {"address", QString("0x%1").arg(e->address, 0, 16)},
+                      {"message", msg->name}};
+      if (opts.json) {
+        QJsonObject values;
+        for (auto s : msg->sigs) {
+          double value = 0;
+          if (s->getValue(e->dat, e->size, &value)) values[s->name] = value;
+        }
+        row["signals"] = values;
+        writeRow(out, opts, row, columns);
+      } else {
+        for (auto s : msg->sigs) {
+          double value = 0;
+          if (!s->getValue(e->dat, e->size, &value)) continue;
+          row["signal"] = s->name;
+          row["value"] = QString::number(value, 'f', s->precision);
+          writeRow(out, opts, row, columns);
+        }
+      }
+    }
+  }
+}
+
+static void exportRaw(QTextStream &out, const CliOptions &opts) {
+  const QStringList columns = csvColumns(Job::Export);
+
+  for (auto e : can->allEvents()) {
+    if (!selected(opts, {.source = e->src, .address = e->address})) continue;
+
+    QJsonObject row{{"route", can->routeName()},
+                    {"time", QString::number(can->toSeconds(e->mono_time), 'f', 3)},
+                    {"addr", "0x" + QString::number(e->address, 16)},
+                    {"bus", e->src},
+                    {"data", "0x" + QByteArray::fromRawData((const char *)e->dat, e->size).toHex().toUpper()}};
+    writeRow(out, opts, row, columns);
+  }
+}
+
+// Reports every bit range whose raw value equals opts.value at some point, like FindSignalDlg's first search.
+static void search(QTextStream &out, const CliOptions &opts) {
+  const QStringList columns = csvColumns(Job::Search);
+
+  cabana::Signal sig{};
+  sig.is_little_endian = opts.little_endian;
+  sig.is_signed = opts.is_signed;
+  for (const auto &[id, m] : can->lastMessages()) {
+    if (!selected(opts, id)) continue;
+
+    const auto &events = can->events(id);
+    const int total_size = m->dat.size() * 8;
+    for (int size = opts.min_size; size <= opts.max_size; ++size) {
+      for (int start = 0; start <= total_size - size; ++start) {
+        sig.start_bit = start;
+        sig.size = size;
+        updateMsbLsb(sig);
+        auto it = std::find_if(events.cbegin(), events.cend(), [&](const CanEvent *e) {
+          return get_raw_value(e->dat, e->size, sig) == opts.value;
+        });
+        if (it != events.cend()) {
+          QJsonObject row{{"route", can->routeName()},
+                          {"bus", id.source},
+                          {"address", QString("0x%1").arg(id.address, 0, 16)},
+                          {"start_bit", start},
+                          {"size", size},
+                          {"time", QString::number(can->toSeconds((*it)->mono_time), 'f', 3)}};
+          writeRow(out, opts, row, columns);
+        }
+      }
+    }
+  }
+}
+
+static int runJob(const QString &route, const CliOptions &opts, bool header) {
+  auto stream = new RouteStream(qApp);
+  can = stream;
+  if (!stream->loadRoute(route, opts.data_dir)) {
+    return 1;
+  }
+
+  // rows are written out as they are produced, a route's output can be much larger than memory
+  QTextStream out(stdout);
+  if (header && !opts.json) out << csvColumns(opts.job).join(",") << "\n";
+  switch (opts.job) {
+    case Job::Decode: decode(out, opts); break;
+    case Job::Export: exportRaw(out, opts); break;
+    case Job::Search: search(out, opts); break;
+  }
+  out.flush();
+  return 0;
+}
+
+// The parsed options forwarded to the worker processes. Workers never print the csv header.
+static QStringList workerArgs(const QCommandLineParser &parser) {
+  QStringList args;
+  for (const QString name : {"job", "dbc", "data_dir", "format", "bus", "address", "value", "min-size", "max-size"}) {
+    if (parser.isSet(name)) args << "--" + name << parser.value(name);
+  }
+  for (const QString name : {"big-endian", "signed"}) {
+    if (parser.isSet(name)) args << "--" + name;
+  }
+  return args << "--jobs" << "1" << "--no-header";
+}
+
+// Spawns one worker process per route, keeping at most `jobs` running. The output of the
+// first route that isn't printed completely is passed through as it comes, the other routes
+// are spooled to temporary files until it's their turn.
+static int runWorkers(const QStringList &routes, const QStringList &worker_args, int jobs) {
+  struct Worker {
+    std::unique_ptr<QTemporaryFile> spool;
+    bool finished = false;
+  };
+  std::vector<Worker> workers(routes.size());
+  QEventLoop loop;
+  int ret = 0, running = 0, next = 0, printed = 0;
+
+  auto print = [](const QByteArray &data) { fwrite(data.constData(), 1, data.size(), stdout); };
+  auto read_output = [&](int idx, QProcess *proc) {
+    QByteArray data = proc->readAllStandardOutput();
+    if (idx == printed) {
+      print(data);
+      return;
+    }
+    auto &spool = workers[idx].spool;
+    if (!spool) {
+      spool = std::make_unique<QTemporaryFile>();
+      if (!spool->open()) qFatal("failed to create a temporary file for the output of %s", qPrintable(routes[idx]));
+    }
+    if (spool->write(data) != data.size()) qFatal("failed to spool the output of %s", qPrintable(routes[idx]));
+  };
+  // moves on to the next route, printing what it spooled so far
+  auto next_route = [&]() {
+    for (++printed; printed < routes.size(); ++printed) {
+      Worker &w = workers[printed];
+      if (w.spool) {
+        w.spool->seek(0);
+        while (!w.spool->atEnd()) print(w.spool->read(1024 * 1024));
+        w.spool.reset();
+      }
+      if (!w.finished) break;
+    }
+  };
+
+  while (printed < routes.size()) {
+    for (; next < routes.size() && running < jobs; ++next, ++running) {
+      auto proc = new QProcess(&loop);
+      proc->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+      QObject::connect(proc, &QProcess::readyReadStandardOutput, [&, idx = next, proc]() { read_output(idx, proc); });
+      auto finish = [&, idx = next, proc](bool ok) {
+        read_output(idx, proc);
+        workers[idx].finished = true;
+        if (idx == printed) next_route();
+        if (!ok) ret = 1;
+        --running;
+        proc->deleteLater();
+        loop.quit();
+      };
+      QObject::connect(proc, qOverload<int, QProcess::ExitStatus>(&QProcess::finished), [finish](int code, QProcess::ExitStatus status) {
+        finish(code == 0 && status == QProcess::NormalExit);
+      });
+      // finished() is not emitted for a worker that doesn't start
+      QObject::connect(proc, &QProcess::errorOccurred, [finish](QProcess::ProcessError error) {
+        if (error == QProcess::FailedToStart) finish(false);
+      });
+      proc->start(QCoreApplication::applicationFilePath(), QStringList(worker_args) << "--" << routes[next]);
+    }
+    loop.exec();
+  }
+  fflush(stdout);
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("cabana_cli");
+
+  QCommandLineParser cmd_parser;
+  cmd_parser.addHelpOption();
+  cmd_parser.addPositionalArgument("routes", "the routes to analyze");
+  cmd_parser.addOption({"job", "decode, export or search. defaults to decode", "job", "decode"});
+  cmd_parser.addOption({"dbc", "dbc file, or the name of a dbc in opendbc", "dbc"});
+  cmd_parser.addOption({"data_dir", "local directory with routes", "data_dir"});
+  cmd_parser.addOption({"format", "csv or json (one object per line). defaults to csv", "format", "csv"});
+  cmd_parser.addOption({"bus", "comma-separated buses. all if not set", "bus"});
+  cmd_parser.addOption({"address", "comma-separated hex addresses. all if not set", "address"});
+  cmd_parser.addOption({"value", "search: raw value to find", "value", "0"});
+  cmd_parser.addOption({"min-size", "search: min signal size in bits", "min-size", "8"});
+  cmd_parser.addOption({"max-size", "search: max signal size in bits", "max-size", "8"});
+  cmd_parser.addOption({"big-endian", "search: big endian signals"});
+  cmd_parser.addOption({"signed", "search: signed signals"});
+  cmd_parser.addOption({"jobs", "number of parallel worker processes", "jobs", QString::number(QThread::idealThreadCount())});
+  cmd_parser.addOption({"no-header", "do not print the csv header"});
+  cmd_parser.process(app);
+
+  const QStringList routes = cmd_parser.positionalArguments();
+  if (routes.isEmpty()) {
+    cmd_parser.showHelp(1);
+  }
+
+  CliOptions opts;
+  const QString job = cmd_parser.value("job");
+  if (job == "decode") {
+    opts.job = Job::Decode;
+  } else if (job == "export") {
+    opts.job = Job::Export;
+  } else if (job == "search") {
+    opts.job = Job::Search;
+  } else {
+    qCritical() << "unknown job" << job;
+    return 1;
+  }
+  opts.json = cmd_parser.value("format") == "json";
+  opts.data_dir = cmd_parser.value("data_dir");
+  for (const auto &bus : cmd_parser.value("bus").split(',', QString::SkipEmptyParts)) {
+    opts.buses.insert(bus.trimmed().toInt());
+  }
+  for (const auto &addr : cmd_parser.value("address").split(',', QString::SkipEmptyParts)) {
+    opts.addresses.insert(addr.trimmed().toUInt(nullptr, 16));
+  }
+  opts.value = cmd_parser.value("value").toDouble();
+  opts.min_size = std::clamp(cmd_parser.value("min-size").toInt(), 1, 64);
+  opts.max_size = std::clamp(cmd_parser.value("max-size").toInt(), opts.min_size, 64);
+  opts.little_endian = !cmd_parser.isSet("big-endian");
+  opts.is_signed = cmd_parser.isSet("signed");
+
+  if (routes.size() > 1) {
+    // the header is printed once here, so it's there even if the first route fails to load
+    if (!opts.json && !cmd_parser.isSet("no-header")) {
+      QTextStream(stdout) << csvColumns(opts.job).join(",") << "\n";
+    }
+    return runWorkers(routes, workerArgs(cmd_parser), std::max(1, cmd_parser.value("jobs").toInt()));
+  }
+
+  if (QString dbc_file = cmd_parser.value("dbc"); !dbc_file.isEmpty()) {
+    if (!QFile::exists(dbc_file)) {
+      dbc_file = QString("%1/%2").arg(OPENDBC_FILE_PATH, dbc_file.endsWith(".dbc") ? dbc_file : dbc_file + ".dbc");
+    }
+    QString error;
+    if (!dbc()->open(SOURCE_ALL, dbc_file, &error)) {
+      qCritical() << "failed to open dbc" << dbc_file << error;
+      return 1;
+    }
+  } else if (opts.job == Job::Decode) {
+    qCritical() << "decode requires --dbc";
+    return 1;
+  }
+
+  return runJob(routes.front(), opts, !cmd_parser.isSet("no-header"));
+}
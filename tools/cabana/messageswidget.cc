@@ -1,6 +1,7 @@
 #include "tools/cabana/messageswidget.h"
 
 #include <limits>
+#include <unordered_map>
 #include <utility>
 
 #include <QCheckBox>
@@ -65,6 +66,11 @@ MessagesWidget::MessagesWidget(QWidget *parent) : menu(new QMenu(this)), QWidget
     view->updateBytesSectionSize();
     updateTitle();
   });
+  QObject::connect(model, &MessageListModel::rowsInserted, [this]() {
+    view->updateBytesSectionSize();
+    updateTitle();
+  });
+  QObject::connect(model, &MessageListModel::rowsRemoved, this, &MessagesWidget::updateTitle);
   QObject::connect(view->selectionModel(), &QItemSelectionModel::currentChanged, [=](const QModelIndex &current, const QModelIndex &previous) {
     if (current.isValid() && current.row() < model->items_.size()) {
       const auto &id = model->items_[current.row()].id;
@@ -244,19 +250,20 @@ void MessageListModel::dbcModified() {
   filterAndSort();
 }
 
-void MessageListModel::sortItems(std::vector<MessageListModel::Item> &items) {
-  auto compare = [this](const auto &l, const auto &r) {
-    switch (sort_column) {
-      case Column::NAME: return std::tie(l.name, l.id) < std::tie(r.name, r.id);
-      case Column::SOURCE: return std::tie(l.id.source, l.id.address) < std::tie(r.id.source, r.id.address);
-      case Column::ADDRESS: return std::tie(l.id.address, l.id.source) < std::tie(r.id.address, r.id.source);
-      case Column::NODE: return std::tie(l.node, l.id) < std::tie(r.node, r.id);
-      case Column::FREQ: return std::tie(can->lastMessage(l.id).freq, l.id) < std::tie(can->lastMessage(r.id).freq, r.id);
-      case Column::COUNT: return std::tie(can->lastMessage(l.id).count, l.id) < std::tie(can->lastMessage(r.id).count, r.id);
-      default: return false; // Default case to suppress compiler warning
-    }
-  };
+bool MessageListModel::lessThan(const Item &l, const Item &r) const {
+  switch (sort_column) {
+    case Column::NAME: return std::tie(l.name, l.id) < std::tie(r.name, r.id);
+    case Column::SOURCE: return std::tie(l.id.source, l.id.address) < std::tie(r.id.source, r.id.address);
+    case Column::ADDRESS: return std::tie(l.id.address, l.id.source) < std::tie(r.id.address, r.id.source);
+    case Column::NODE: return std::tie(l.node, l.id) < std::tie(r.node, r.id);
+    case Column::FREQ: return std::tie(can->lastMessage(l.id).freq, l.id) < std::tie(can->lastMessage(r.id).freq, r.id);
+    case Column::COUNT: return std::tie(can->lastMessage(l.id).count, l.id) < std::tie(can->lastMessage(r.id).count, r.id);
+    default: return false; // Default case to suppress compiler warning
+  }
+}
 
+void MessageListModel::sortItems(std::vector<MessageListModel::Item> &items) {
+  auto compare = [this](const auto &l, const auto &r) { return lessThan(l, r); };
   if (sort_order == Qt::DescendingOrder)
     std::stable_sort(items.rbegin(), items.rend(), compare);
   else
@@ -320,6 +327,20 @@ bool MessageListModel::match(const MessageListModel::Item &item) {
   return match;
 }
 
+std::optional<MessageListModel::Item> MessageListModel::createItem(const MessageId &id) {
+  bool active = isMessageActive(id);
+  if (active || show_inactive_messages) {
+    auto msg = dbc()->msg(id);
+    Item item = {.id = id,
+                 .name = msg ? msg->name : UNTITLED,
+                 .node = msg ? msg->transmitter : QString(),
+                 .active = active};
+    if (match(item))
+      return item;
+  }
+  return std::nullopt;
+}
+
 bool MessageListModel::filterAndSort() {
   // merge CAN and DBC messages
   std::vector<MessageId> all_messages;
@@ -335,31 +356,86 @@ bool MessageListModel::filterAndSort() {
   std::vector<Item> items;
   items.reserve(all_messages.size());
   for (const auto &id : all_messages) {
-    bool active = isMessageActive(id);
-    if (active || show_inactive_messages) {
-      auto msg = dbc()->msg(id);
-      Item item = {.id = id,
-                  .active = active,
-                  .name = msg ? msg->name : UNTITLED,
-                  .node = msg ? msg->transmitter : QString()};
-      if (match(item))
-        items.emplace_back(item);
-    }
+    if (auto item = createItem(id))
+      items.emplace_back(std::move(*item));
   }
   sortItems(items);
+  return updateItems(std::move(items));
+}
 
-  if (items_ != items) {
+bool MessageListModel::updateItems(std::vector<Item> &&items) {
+  if (items_ == items) return false;
+
+  bool same_ids = items.size() == items_.size() &&
+                  std::all_of(items.cbegin(), items.cend(), [this](const auto &item) { return item_ids_.count(item.id); });
+  if (same_ids) {
+    // Only the order changed: move the rows and keep selection and scroll position instead of resetting the model.
+    emit layoutAboutToBeChanged({}, QAbstractItemModel::VerticalSortHint);
+    std::unordered_map<MessageId, int> new_rows;
+    new_rows.reserve(items.size());
+    for (int i = 0; i < items.size(); ++i) {
+      new_rows[items[i].id] = i;
+    }
+    const auto old_indexes = persistentIndexList();
+    QModelIndexList new_indexes;
+    new_indexes.reserve(old_indexes.size());
+    for (const auto &idx : old_indexes) {
+      new_indexes.push_back(index(new_rows[items_[idx.row()].id], idx.column()));
+    }
+    items_ = std::move(items);
+    changePersistentIndexList(old_indexes, new_indexes);
+    emit layoutChanged({}, QAbstractItemModel::VerticalSortHint);
+  } else {
     beginResetModel();
     items_ = std::move(items);
+    item_ids_.clear();
+    for (const auto &item : items_) {
+      item_ids_.insert(item.id);
+    }
     endResetModel();
-    return true;
   }
-  return false;
+  return true;
+}
+
+void MessageListModel::insertItems(const std::set<MessageId> &new_msgs) {
+  for (const auto &id : new_msgs) {
+    if (item_ids_.count(id)) continue;
+
+    // The received message replaces the row of its DBC definition
+    removeItem(MessageId{.source = INVALID_SOURCE, .address = id.address});
+    auto item = createItem(id);
+    if (!item) continue;
+
+    // items_ is sorted, insert the new row at its sorted position
+    auto compare = [this](const auto &l, const auto &r) { return lessThan(l, r); };
+    int row = sort_order == Qt::DescendingOrder
+                  ? std::distance(std::upper_bound(items_.rbegin(), items_.rend(), *item, compare), items_.rend())
+                  : std::distance(items_.begin(), std::upper_bound(items_.begin(), items_.end(), *item, compare));
+    beginInsertRows({}, row, row);
+    items_.insert(items_.begin() + row, std::move(*item));
+    item_ids_.insert(id);
+    endInsertRows();
+  }
+}
+
+void MessageListModel::removeItem(const MessageId &id) {
+  if (item_ids_.erase(id)) {
+    auto it = std::find_if(items_.begin(), items_.end(), [&id](const auto &item) { return item.id == id; });
+    int row = std::distance(items_.begin(), it);
+    beginRemoveRows({}, row, row);
+    items_.erase(it);
+    endRemoveRows();
+  }
 }
 
 void MessageListModel::msgsReceived(const std::set<MessageId> *new_msgs, bool has_new_ids) {
-  if (has_new_ids || ((filters_.count(Column::FREQ) || filters_.count(Column::COUNT) || filters_.count(Column::DATA)) &&
-                      ++sort_threshold_ == settings.fps)) {
+  bool refilter = (filters_.count(Column::FREQ) || filters_.count(Column::COUNT) || filters_.count(Column::DATA)) &&
+                  ++sort_threshold_ == settings.fps;
+  bool sort_by_value = sort_column == Column::FREQ || sort_column == Column::COUNT;
+  if (has_new_ids && new_msgs && !refilter && !sort_by_value) {
+    // Rows are still in order, only insert the new ones
+    insertItems(*new_msgs);
+  } else if (has_new_ids || refilter) {
     sort_threshold_ = 0;
     if (filterAndSort()) return;
   }
@@ -408,7 +484,7 @@ void MessageView::updateBytesSectionSize() {
   int max_bytes = 8;
   if (!delegate->multipleLines()) {
     for (const auto &[_, m] : can->lastMessages()) {
-      max_bytes = std::max<int>(max_bytes, m.dat.size());
+      max_bytes = std::max<int>(max_bytes, m->dat.size());
     }
   }
   setUniformRowHeights(!delegate->multipleLines());
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <optional>
 #include <set>
+#include <unordered_set>
 #include <vector>
 
 #include <QAbstractTableModel>
@@ -54,9 +55,15 @@ public:
   bool show_inactive_messages = true;
 
 private:
+  bool lessThan(const Item &l, const Item &r) const;
   void sortItems(std::vector<MessageListModel::Item> &items);
   bool match(const MessageListModel::Item &id);
+  std::optional<Item> createItem(const MessageId &id);
+  void insertItems(const std::set<MessageId> &new_msgs);
+  void removeItem(const MessageId &id);
+  bool updateItems(std::vector<Item> &&items);
 
+  std::unordered_set<MessageId> item_ids_;
   QMap<int, QString> filters_;
   std::set<MessageId> dbc_messages_;
   int sort_column = 0;
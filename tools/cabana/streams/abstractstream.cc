@@ -10,6 +10,17 @@ static const int EVENT_NEXT_BUFFER_SIZE = 6 * 1024 * 1024;  // 6MB
 
 AbstractStream *can = nullptr;
 
+// Copy-on-write: the UI thread may still hold a snapshot of this CanData in last_msgs.
+// Must be called with mutex_ held.
+static CanData &detach(std::shared_ptr<CanData> &m) {
+  if (!m) {
+    m = std::make_shared<CanData>();
+  } else if (m.use_count() > 1) {
+    m = std::make_shared<CanData>(*m);
+  }
+  return *m;
+}
+
 AbstractStream::AbstractStream(QObject *parent) : QObject(parent) {
   assert(parent != nullptr);
   event_buffer_ = std::make_unique<MonotonicBuffer>(EVENT_NEXT_BUFFER_SIZE);
@@ -35,10 +46,13 @@ void AbstractStream::updateMasks() {
   // clear bit change counts
   for (auto &[id, m] : messages_) {
     auto &mask = masks_[id];
-    const int size = std::min(mask.size(), m.last_changes.size());
+    if (mask.empty()) continue;
+
+    auto &data = detach(m);
+    const int size = std::min(mask.size(), data.last_changes.size());
     for (int i = 0; i < size; ++i) {
       for (int j = 0; j < 8; ++j) {
-        if (((mask[i] >> (7 - j)) & 1) != 0) m.last_changes[i].bit_change_counts[j] = 0;
+        if (((mask[i] >> (7 - j)) & 1) != 0) data.last_changes[i].bit_change_counts[j] = 0;
       }
     }
   }
@@ -53,7 +67,7 @@ size_t AbstractStream::suppressHighlighted() {
   std::lock_guard lk(mutex_);
   size_t cnt = 0;
   for (auto &[_, m] : messages_) {
-    for (auto &last_change : m.last_changes) {
+    for (auto &last_change : detach(m).last_changes) {
       const double dt = current_sec_ - last_change.ts;
       if (dt < 2.0) {
         last_change.suppressed = true;
@@ -68,7 +82,8 @@ size_t AbstractStream::suppressHighlighted() {
 void AbstractStream::clearSuppressed() {
   std::lock_guard lk(mutex_);
   for (auto &[_, m] : messages_) {
-    std::for_each(m.last_changes.begin(), m.last_changes.end(), [](auto &c) { c.suppressed = false; });
+    auto &data = detach(m);
+    std::for_each(data.last_changes.begin(), data.last_changes.end(), [](auto &c) { c.suppressed = false; });
   }
 }
 
@@ -80,8 +95,9 @@ void AbstractStream::updateLastMessages() {
   {
     std::lock_guard lk(mutex_);
     for (const auto &id : new_msgs_) {
-      const auto &can_data = messages_[id];
-      current_sec_ = std::max(current_sec_, can_data.ts);
+      auto &can_data = messages_[id];
+      detach(can_data).updateColors();
+      current_sec_ = std::max(current_sec_, can_data->ts);
       last_msgs[id] = can_data;
       sources.insert(id.source);
     }
@@ -110,7 +126,7 @@ void AbstractStream::setTimeRange(const std::optional<std::pair<double, double>>
 
 void AbstractStream::updateEvent(const MessageId &id, double sec, const uint8_t *data, uint8_t size) {
   std::lock_guard lk(mutex_);
-  messages_[id].compute(id, data, size, sec, getSpeed(), masks_[id]);
+  detach(messages_[id]).compute(id, data, size, sec, getSpeed(), masks_[id]);
   new_msgs_.insert(id);
 }
 
@@ -123,7 +139,7 @@ const std::vector<const CanEvent *> &AbstractStream::events(const MessageId &id)
 const CanData &AbstractStream::lastMessage(const MessageId &id) const {
   static CanData empty_data = {};
   auto it = last_msgs.find(id);
-  return it != last_msgs.end() ? it->second : empty_data;
+  return it != last_msgs.end() ? *it->second : empty_data;
 }
 
 // it is thread safe to update data in updateLastMsgsTo.
@@ -131,26 +147,28 @@ const CanData &AbstractStream::lastMessage(const MessageId &id) const {
 void AbstractStream::updateLastMsgsTo(double sec) {
   current_sec_ = sec;
   uint64_t last_ts = toMonoTime(sec);
-  std::unordered_map<MessageId, CanData> msgs;
+  std::unordered_map<MessageId, std::shared_ptr<CanData>> msgs;
   msgs.reserve(events_.size());
 
   for (const auto &[id, ev] : events_) {
     auto it = std::upper_bound(ev.begin(), ev.end(), last_ts, CompareCanEvent());
     if (it != ev.begin()) {
-      auto &m = msgs[id];
+      auto m = std::make_shared<CanData>();
       double freq = 0;
       // Keep suppressed bits.
       if (auto old_m = messages_.find(id); old_m != messages_.end()) {
-        freq = old_m->second.freq;
-        m.last_changes.reserve(old_m->second.last_changes.size());
-        std::transform(old_m->second.last_changes.cbegin(), old_m->second.last_changes.cend(),
-                       std::back_inserter(m.last_changes),
+        const auto &old_changes = old_m->second->last_changes;
+        freq = old_m->second->freq;
+        m->last_changes.reserve(old_changes.size());
+        std::transform(old_changes.cbegin(), old_changes.cend(), std::back_inserter(m->last_changes),
                        [](const auto &change) { return CanData::ByteLastChange{.suppressed = change.suppressed}; });
       }
 
       auto prev = std::prev(it);
-      m.compute(id, (*prev)->dat, (*prev)->size, toSeconds((*prev)->mono_time), getSpeed(), {}, freq);
-      m.count = std::distance(ev.begin(), prev) + 1;
+      m->compute(id, (*prev)->dat, (*prev)->size, toSeconds((*prev)->mono_time), getSpeed(), {}, freq);
+      m->count = std::distance(ev.begin(), prev) + 1;
+      std::for_each(m->last_changes.begin(), m->last_changes.end(), [&m](auto &c) { c.color_count = m->count; });
+      msgs[id] = std::move(m);
     }
   }
 
@@ -159,7 +177,11 @@ void AbstractStream::updateLastMsgsTo(double sec) {
   bool id_changed = messages_.size() != last_msgs.size() ||
                     std::any_of(messages_.cbegin(), messages_.cend(),
                                 [this](const auto &m) { return !last_msgs.count(m.first); });
-  last_msgs = messages_;
+  last_msgs.clear();
+  last_msgs.reserve(messages_.size());
+  for (const auto &[id, m] : messages_) {
+    last_msgs[id] = m;
+  }
   emit msgsReceived(nullptr, id_changed);
 }
 
@@ -245,25 +267,38 @@ void CanData::compute(const MessageId &msg_id, const uint8_t *can_data, const in
     freq = !in_freq ? calc_freq(msg_id, ts) : in_freq;
   }
 
+  constexpr float fade_time = 2.0;
+  alpha_delta = 1.0 / (freq + 1) / (fade_time * playback_speed);
+
   if (dat.size() != size) {
     dat.resize(size);
     colors.assign(size, QColor(0, 0, 0, 0));
     last_changes.resize(size);
-    std::for_each(last_changes.begin(), last_changes.end(), [current_sec](auto &c) { c.ts = current_sec; });
+    std::for_each(last_changes.begin(), last_changes.end(), [this, current_sec](auto &c) {
+      c.ts = current_sec;
+      c.color_count = count;
+    });
   } else {
     constexpr int periodic_threshold = 10;
-    constexpr float fade_time = 2.0;
-    const float alpha_delta = 1.0 / (freq + 1) / (fade_time * playback_speed);
 
-    for (int i = 0; i < size; ++i) {
-      auto &last_change = last_changes[i];
+    // Compare 8 bytes at a time, only bytes in a lane that differs need further work.
+    for (int lane = 0; lane < size; lane += sizeof(uint64_t)) {
+      const int lane_size = std::min<int>(sizeof(uint64_t), size - lane);
+      uint64_t last_lane = 0, cur_lane = 0;
+      memcpy(&last_lane, dat.data() + lane, lane_size);
+      memcpy(&cur_lane, can_data + lane, lane_size);
+      if (last_lane == cur_lane) continue;
 
-      uint8_t mask_byte = last_change.suppressed ? 0x00 : 0xFF;
-      if (i < mask.size()) mask_byte &= ~(mask[i]);
+      for (int i = lane; i < lane + lane_size; ++i) {
+        auto &last_change = last_changes[i];
+
+        uint8_t mask_byte = last_change.suppressed ? 0x00 : 0xFF;
+        if (i < mask.size()) mask_byte &= ~(mask[i]);
+
+        const uint8_t last = dat[i] & mask_byte;
+        const uint8_t cur = can_data[i] & mask_byte;
+        if (last == cur) continue;
 
-      const uint8_t last = dat[i] & mask_byte;
-      const uint8_t cur = can_data[i] & mask_byte;
-      if (last != cur) {
         const int delta = cur - last;
         // Keep track if signal is changing randomly, or mostly moving in the same direction
         last_change.same_delta_counter += std::signbit(delta) == std::signbit(last_change.delta) ? 1 : -4;
@@ -275,25 +310,34 @@ void CanData::compute(const MessageId &msg_id, const uint8_t *can_data, const in
           // Last change was while ago, choose color based on delta up or down
           colors[i] = getColor(cur > last ? CYAN : RED);
         } else {
-          // Periodic changes
+          // Periodic changes, blend with the color faded up to the previous frame
+          colors[i].setAlphaF(std::max(0.0f, (float)colors[i].alphaF() - (count - 1 - last_change.color_count) * alpha_delta));
           colors[i] = blend(colors[i], getColor(GREYISH_BLUE));
         }
+        last_change.color_count = count;
 
         // Track bit level changes
-        const uint8_t diff = (cur ^ last);
-        for (int bit = 0; bit < 8; bit++) {
-          if (diff & (1u << bit)) {
-            ++last_change.bit_change_counts[7 - bit];
-          }
+        for (uint8_t diff = cur ^ last; diff != 0; diff &= diff - 1) {
+          ++last_change.bit_change_counts[7 - __builtin_ctz(diff)];
         }
 
         last_change.ts = ts;
         last_change.delta = delta;
-      } else {
-        // Fade out
-        colors[i].setAlphaF(std::max(0.0, colors[i].alphaF() - alpha_delta));
       }
     }
   }
   memcpy(dat.data(), can_data, size);
 }
+
+void CanData::updateColors() {
+  for (int i = 0; i < colors.size(); ++i) {
+    auto &last_change = last_changes[i];
+    if (const uint32_t frames = count - last_change.color_count; frames > 0) {
+      // Fade out
+      if (colors[i].alpha() > 0) {
+        colors[i].setAlphaF(std::max(0.0f, (float)colors[i].alphaF() - frames * alpha_delta));
+      }
+      last_change.color_count = count;
+    }
+  }
+}
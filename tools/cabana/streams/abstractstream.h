@@ -21,6 +21,8 @@
 struct CanData {
   void compute(const MessageId &msg_id, const uint8_t *dat, const int size, double current_sec,
                double playback_speed, const std::vector<uint8_t> &mask, double in_freq = 0);
+  // Apply the pending fade-out to colors. compute() only touches colors of changed bytes.
+  void updateColors();
 
   double ts = 0.;
   uint32_t count = 0;
@@ -33,10 +35,12 @@ struct CanData {
     int delta = 0;
     int same_delta_counter = 0;
     bool suppressed = false;
+    uint32_t color_count = 0;  // value of count when colors[i] was last updated
     std::array<uint32_t, 8> bit_change_counts;
   };
   std::vector<ByteLastChange> last_changes;
   double last_freq_update_ts = 0;
+  float alpha_delta = 0;  // alpha faded per unchanged frame
 };
 
 struct CanEvent {
@@ -80,7 +84,7 @@ public:
   inline uint64_t toMonoTime(double sec) const { return beginMonoTime() + std::max(sec, 0.0) * 1e9; }
   inline double toSeconds(uint64_t mono_time) const { return std::max(0.0, (mono_time - beginMonoTime()) / 1e9); }
 
-  inline const std::unordered_map<MessageId, CanData> &lastMessages() const { return last_msgs; }
+  inline const std::unordered_map<MessageId, std::shared_ptr<const CanData>> &lastMessages() const { return last_msgs; }
   inline const MessageEventsMap &eventsMap() const { return events_; }
   inline const std::vector<const CanEvent *> &allEvents() const { return all_events_; }
   const CanData &lastMessage(const MessageId &id) const;
@@ -119,13 +123,15 @@ private:
   void updateMasks();
 
   MessageEventsMap events_;
-  std::unordered_map<MessageId, CanData> last_msgs;
+  // Snapshots shared with the stream thread. CanData is copied on write, so
+  // publishing an update only copies pointers.
+  std::unordered_map<MessageId, std::shared_ptr<const CanData>> last_msgs;
   std::unique_ptr<MonotonicBuffer> event_buffer_;
 
   // Members accessed in multiple threads. (mutex protected)
   std::mutex mutex_;
   std::set<MessageId> new_msgs_;
-  std::unordered_map<MessageId, CanData> messages_;
+  std::unordered_map<MessageId, std::shared_ptr<CanData>> messages_;
   std::unordered_map<MessageId, std::vector<uint8_t>> masks_;
 };
 
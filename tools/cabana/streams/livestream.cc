@@ -2,33 +2,164 @@
 
 #include <QThread>
 #include <algorithm>
-#include <fstream>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <memory>
+#include <string>
+#include <thread>
+
+#include <zstd.h>
+#include <QDebug>
 
 #include "common/timing.h"
 #include "common/util.h"
 
+// Writes the live stream to zstd compressed rlog segments on a background thread.
+// handleEvent only appends to a memory buffer, so slow disks never stall the stream thread.
 struct LiveStream::Logger {
-  Logger() : start_ts(seconds_since_epoch()), segment_num(-1) {}
+  static constexpr int COMPRESSION_LEVEL = 3;
+  static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+  static constexpr size_t MAX_PENDING_BYTES = 64 * 1024 * 1024;
+
+  struct Chunk {
+    int segment;
+    std::string data;
+  };
+
+  Logger() : start_ts(seconds_since_epoch()) {
+    cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, COMPRESSION_LEVEL);
+    writer = std::thread(&Logger::writerThread, this);
+  }
+
+  ~Logger() {
+    {
+      std::lock_guard lk(lock);
+      exit = true;
+    }
+    cv.notify_one();
+    writer.join();
+    ZSTD_freeCCtx(cctx);
+  }
 
+  // called in streamThread
   void write(kj::ArrayPtr<capnp::word> data) {
+    auto bytes = data.asBytes();
     int n = (seconds_since_epoch() - start_ts) / 60.0;
-    if (std::exchange(segment_num, n) != segment_num) {
+    bool notify = false;
+    {
+      std::lock_guard lk(lock);
+      if (pending_bytes + bytes.size() > MAX_PENDING_BYTES) {
+        if (dropped_events++ % 1000 == 0) qWarning() << "live stream logger is falling behind, dropped" << dropped_events << "events";
+        return;
+      }
+      if (chunks.empty() || chunks.back().segment != n || chunks.back().data.size() >= CHUNK_SIZE) {
+        notify = !chunks.empty();
+        chunks.push_back({.segment = n});
+        chunks.back().data.reserve(CHUNK_SIZE);
+      }
+      chunks.back().data.append((const char *)bytes.begin(), bytes.size());
+      pending_bytes += bytes.size();
+    }
+    if (notify) cv.notify_one();
+  }
+
+  void writerThread() {
+    std::deque<Chunk> to_write;
+    bool done = false;
+    while (!done) {
+      {
+        std::unique_lock lk(lock);
+        // Write full chunks as soon as they are available, the partial one at least once per second.
+        cv.wait_for(lk, std::chrono::seconds(1), [this]() { return exit || chunks.size() > 1; });
+        done = exit;
+        to_write = std::move(chunks);
+        chunks.clear();
+      }
+      for (const auto &chunk : to_write) {
+        writeChunk(chunk);
+        // the chunk counts against MAX_PENDING_BYTES until it's written
+        std::lock_guard lk(lock);
+        pending_bytes -= chunk.data.size();
+      }
+      to_write.clear();
+    }
+    closeSegment();
+  }
+
+  void writeChunk(const Chunk &chunk) {
+    if (chunk.segment != segment_num) {
+      closeSegment();
+      segment_num = chunk.segment;
       QString dir = QString("%1/%2--%3")
                         .arg(settings.log_path)
                         .arg(QDateTime::fromSecsSinceEpoch(start_ts).toString("yyyy-MM-dd--hh-mm-ss"))
-                        .arg(n);
+                        .arg(segment_num);
       util::create_directories(dir.toStdString(), 0755);
-      fs.reset(new std::ofstream((dir + "/rlog").toStdString(), std::ios::binary | std::ios::out));
+      file = fopen((dir + "/rlog.zst").toStdString().c_str(), "wb");
+      if (!file) qWarning() << "failed to open" << dir + "/rlog.zst";
     }
+    // flush every chunk, so the segment is readable up to the last write
+    compress(chunk.data.data(), chunk.data.size(), ZSTD_e_flush);
+  }
 
-    auto bytes = data.asBytes();
-    fs->write((const char*)bytes.begin(), bytes.size());
+  void closeSegment() {
+    compress(nullptr, 0, ZSTD_e_end);
+    if (file) {
+      if (fclose(file) != 0) qWarning() << "failed to close live stream log:" << strerror(errno);
+      file = nullptr;
+    }
   }
 
-  std::unique_ptr<std::ofstream> fs;
-  int segment_num;
+  // on errors the rest of the segment is not written, logging continues with the next one
+  void abortSegment() {
+    fclose(file);
+    file = nullptr;
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+  }
+
+  void compress(const char *data, size_t size, ZSTD_EndDirective mode) {
+    if (!file) return;
+
+    ZSTD_inBuffer input = {data, size, 0};
+    size_t remaining = 0;
+    do {
+      out_buf.resize(ZSTD_CStreamOutSize());
+      ZSTD_outBuffer output = {out_buf.data(), out_buf.size(), 0};
+      remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+      if (ZSTD_isError(remaining)) {
+        qWarning() << "zstd compression failed:" << ZSTD_getErrorName(remaining);
+        abortSegment();
+        return;
+      }
+      if (fwrite(out_buf.data(), 1, output.pos, file) != output.pos) {
+        qWarning() << "failed to write live stream log:" << strerror(errno);
+        abortSegment();
+        return;
+      }
+    } while (remaining > 0);
+  }
+
+  // Members accessed in multiple threads. (lock protected)
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<Chunk> chunks;
+  size_t pending_bytes = 0;
+  uint64_t dropped_events = 0;
+  bool exit = false;
+
+  // Members only accessed in the writer thread
+  ZSTD_CCtx *cctx = nullptr;
+  FILE *file = nullptr;
+  int segment_num = -1;
+  std::vector<char> out_buf;
+
   uint64_t start_ts;
+  std::thread writer;
 };
 
 LiveStream::LiveStream(QObject *parent) : AbstractStream(parent) {
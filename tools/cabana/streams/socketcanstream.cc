@@ -1,5 +1,21 @@
 #include "tools/cabana/streams/socketcanstream.h"
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <net/if.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#endif
+
 #include <QDebug>
 #include <QFormLayout>
 #include <QHBoxLayout>
@@ -7,63 +23,202 @@
 #include <QPushButton>
 #include <QThread>
 
+#include "common/timing.h"
+
 SocketCanStream::SocketCanStream(QObject *parent, SocketCanStreamConfig config_) : config(config_), LiveStream(parent) {
   if (!available()) {
-    throw std::runtime_error("SocketCAN plugin not available");
+    throw std::runtime_error("SocketCAN not available");
   }
 
-  qDebug() << "Connecting to SocketCAN device" << config.device;
+  qDebug() << "Connecting to SocketCAN devices" << config.devices;
   if (!connect()) {
+    closeSockets();
     throw std::runtime_error("Failed to connect to SocketCAN device");
   }
 }
 
+SocketCanStream::~SocketCanStream() {
+  stop();
+  closeSockets();
+}
+
 bool SocketCanStream::available() {
-  return QCanBus::instance()->plugins().contains("socketcan");
+#ifdef __linux__
+  int fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (fd < 0) return false;
+
+  close(fd);
+  return true;
+#else
+  return false;
+#endif
 }
 
 bool SocketCanStream::connect() {
-  // Connecting might generate some warnings about missing socketcan/libsocketcan libraries
-  // These are expected and can be ignored, we don't need the advanced features of libsocketcan
-  QString errorString;
-  device.reset(QCanBus::instance()->createDevice("socketcan", config.device, &errorString));
-
-  if (!device) {
-    qDebug() << "Failed to create SocketCAN device" << errorString;
+#ifdef __linux__
+  if (config.devices.isEmpty()) {
+    qDebug() << "No SocketCAN device given";
     return false;
   }
 
-  if (!device->connectDevice()) {
-    qDebug() << "Failed to connect to device";
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    qDebug() << "Failed to create epoll instance" << strerror(errno);
     return false;
   }
 
+  for (int bus = 0; bus < config.devices.size(); ++bus) {
+    const QString &device = config.devices[bus];
+    int fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+    if (fd < 0) {
+      qDebug() << "Failed to create socket for" << device << strerror(errno);
+      return false;
+    }
+    sockets.push_back(fd);
+
+    struct ifreq ifr = {};
+    strncpy(ifr.ifr_name, device.toStdString().c_str(), IFNAMSIZ - 1);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+      qDebug() << "Failed to find SocketCAN device" << device << strerror(errno);
+      return false;
+    }
+
+    // CAN-FD frames are received if the interface supports them, classic CAN otherwise
+    int enable = 1;
+    setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof(enable));
+    // Kernel receive timestamps, hardware timestamps are reported as well when the adapter supports them
+    int timestamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                       SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &timestamping, sizeof(timestamping)) < 0) {
+      qDebug() << "SO_TIMESTAMPING not supported on" << device << ", frames are stamped on receive";
+    }
+
+    struct sockaddr_can addr = {};
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      qDebug() << "Failed to bind SocketCAN device" << device << strerror(errno);
+      return false;
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u32 = bus;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      qDebug() << "Failed to add" << device << "to epoll" << strerror(errno);
+      return false;
+    }
+  }
   return true;
+#else
+  return false;
+#endif
+}
+
+void SocketCanStream::closeSockets() {
+  for (int fd : sockets) {
+    close(fd);
+  }
+  sockets.clear();
+  if (epoll_fd >= 0) {
+    close(epoll_fd);
+    epoll_fd = -1;
+  }
 }
 
 void SocketCanStream::streamThread() {
+#ifdef __linux__
+  constexpr int BATCH_SIZE = 64;
+  constexpr int CONTROL_SIZE = CMSG_SPACE(sizeof(struct scm_timestamping));
+
+  struct Frame {
+    uint64_t mono_time;
+    uint8_t bus;
+    uint32_t address;
+    uint8_t size;
+    uint8_t dat[CANFD_MAX_DLEN];
+  };
+
+  struct canfd_frame frames[BATCH_SIZE];
+  struct iovec iovs[BATCH_SIZE];
+  struct mmsghdr msgs[BATCH_SIZE];
+  alignas(struct cmsghdr) char control[BATCH_SIZE][CONTROL_SIZE];
+  struct epoll_event events[16];
+  std::vector<Frame> received;
+  uint64_t last_mono_time = 0;
+
   while (!QThread::currentThread()->isInterruptionRequested()) {
-    QThread::msleep(1);
+    int n = epoll_wait(epoll_fd, events, std::size(events), 100);
+    if (n <= 0) continue;
 
-    auto frames = device->readAllFrames();
-    if (frames.size() == 0) continue;
+    // Kernel timestamps are CLOCK_REALTIME, convert them to the boot time used by logMonoTime
+    const int64_t realtime_to_boot = (int64_t)nanos_since_boot() - (int64_t)nanos_since_epoch();
+    received.clear();
 
-    MessageBuilder msg;
-    auto evt = msg.initEvent();
-    auto canData = evt.initCan(frames.size());
+    for (int e = 0; e < n; ++e) {
+      const uint8_t bus = events[e].data.u32;
+      int cnt = 0;
+      do {
+        for (int i = 0; i < BATCH_SIZE; ++i) {
+          iovs[i] = {.iov_base = &frames[i], .iov_len = sizeof(frames[i])};
+          msgs[i].msg_hdr = {};
+          msgs[i].msg_hdr.msg_iov = &iovs[i];
+          msgs[i].msg_hdr.msg_iovlen = 1;
+          msgs[i].msg_hdr.msg_control = control[i];
+          msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+        }
+        cnt = recvmmsg(sockets[bus], msgs, BATCH_SIZE, MSG_DONTWAIT, nullptr);
 
-    for (uint i = 0; i < frames.size(); i++) {
-      if (!frames[i].isValid()) continue;
+        for (int i = 0; i < cnt; ++i) {
+          const auto &f = frames[i];
+          if (msgs[i].msg_len != CAN_MTU && msgs[i].msg_len != CANFD_MTU) continue;
+          if (f.can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG)) continue;
 
-      canData[i].setAddress(frames[i].frameId());
-      canData[i].setSrc(0);
+          uint64_t mono_time = 0;
+          for (auto cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+              struct scm_timestamping ts;
+              memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+              // ts[0] is the kernel software timestamp. ts[2] is in the adapter's clock domain and not comparable.
+              if (ts.ts[0].tv_sec || ts.ts[0].tv_nsec) {
+                mono_time = ts.ts[0].tv_sec * 1000000000ULL + ts.ts[0].tv_nsec + realtime_to_boot;
+              }
+            }
+          }
 
-      auto payload = frames[i].payload();
-      canData[i].setDat(kj::arrayPtr((uint8_t*)payload.data(), payload.size()));
+          auto &frame = received.emplace_back();
+          frame.mono_time = mono_time ? mono_time : nanos_since_boot();
+          frame.bus = bus;
+          frame.address = f.can_id & ((f.can_id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+          frame.size = std::min<uint8_t>(f.len, CANFD_MAX_DLEN);
+          memcpy(frame.dat, f.data, frame.size);
+        }
+      } while (cnt == BATCH_SIZE);
     }
+    if (received.empty()) continue;
+
+    // Frames of all buses are ordered by receive time, frames with the same
+    // timestamp share an event so every CanEvent keeps its own time.
+    std::stable_sort(received.begin(), received.end(), [](auto &l, auto &r) { return l.mono_time < r.mono_time; });
 
-    handleEvent(capnp::messageToFlatArray(msg));
+    for (auto first = received.begin(); first != received.end();) {
+      auto last = std::find_if(first, received.end(), [&](auto &f) { return f.mono_time != first->mono_time; });
+      // times never go backwards, also across batches
+      last_mono_time = std::max(last_mono_time, first->mono_time);
+
+      MessageBuilder msg;
+      auto evt = msg.initEvent();
+      evt.setLogMonoTime(last_mono_time);
+      auto canData = evt.initCan(last - first);
+      for (int i = 0; first != last; ++first, ++i) {
+        canData[i].setAddress(first->address);
+        canData[i].setSrc(first->bus);
+        canData[i].setDat(kj::arrayPtr(first->dat, first->size));
+      }
+      handleEvent(capnp::messageToFlatArray(msg));
+    }
   }
+#endif
 }
 
 OpenSocketCanWidget::OpenSocketCanWidget(QWidget *parent) : AbstractOpenStreamWidget(parent) {
@@ -73,29 +228,41 @@ OpenSocketCanWidget::OpenSocketCanWidget(QWidget *parent) : AbstractOpenStreamWi
   QFormLayout *form_layout = new QFormLayout();
 
   QHBoxLayout *device_layout = new QHBoxLayout();
-  device_edit = new QComboBox();
-  device_edit->setFixedWidth(300);
-  device_layout->addWidget(device_edit);
+  device_list = new QListWidget();
+  device_list->setFixedWidth(300);
+  device_list->setToolTip(tr("Check the devices to stream from, the n-th checked device is bus n"));
+  device_layout->addWidget(device_list);
 
   QPushButton *refresh = new QPushButton(tr("Refresh"));
   refresh->setFixedWidth(100);
-  device_layout->addWidget(refresh);
-  form_layout->addRow(tr("Device"), device_layout);
+  device_layout->addWidget(refresh, 0, Qt::AlignTop);
+  form_layout->addRow(tr("Devices"), device_layout);
   main_layout->addLayout(form_layout);
 
   main_layout->addStretch(1);
 
   QObject::connect(refresh, &QPushButton::clicked, this, &OpenSocketCanWidget::refreshDevices);
-  QObject::connect(device_edit, &QComboBox::currentTextChanged, this, [=]{ config.device = device_edit->currentText(); });
+  QObject::connect(device_list, &QListWidget::itemChanged, this, [=]() {
+    config.devices.clear();
+    for (int i = 0; i < device_list->count(); ++i) {
+      if (device_list->item(i)->checkState() == Qt::Checked) {
+        config.devices.push_back(device_list->item(i)->text());
+      }
+    }
+    emit enableOpenButton(!config.devices.isEmpty());
+  });
 
   // Populate devices
   refreshDevices();
 }
 
 void OpenSocketCanWidget::refreshDevices() {
-  device_edit->clear();
-  for (auto device : QCanBus::instance()->availableDevices(QStringLiteral("socketcan"))) {
-    device_edit->addItem(device.name());
+  device_list->clear();
+  auto devices = QCanBus::instance()->availableDevices(QStringLiteral("socketcan"));
+  for (int i = 0; i < devices.size(); ++i) {
+    auto item = new QListWidgetItem(devices[i].name(), device_list);
+    item->setFlags(item->flags() | Qt::ItemIsUserCheckable);
+    item->setCheckState(i == 0 ? Qt::Checked : Qt::Unchecked);
   }
 }
 
@@ -1,35 +1,36 @@
 #pragma once
 
-#include <memory>
+#include <vector>
 
 #include <QtSerialBus/QCanBus>
-#include <QtSerialBus/QCanBusDevice>
 #include <QtSerialBus/QCanBusDeviceInfo>
-#include <QComboBox>
+#include <QListWidget>
 
 #include "tools/cabana/streams/livestream.h"
 
 struct SocketCanStreamConfig {
-  QString device = ""; // TODO: support multiple devices/buses at once
+  QStringList devices; // the index of a device is used as its bus number
 };
 
 class SocketCanStream : public LiveStream {
   Q_OBJECT
 public:
   SocketCanStream(QObject *parent, SocketCanStreamConfig config_ = {});
-  ~SocketCanStream() { stop(); }
+  ~SocketCanStream();
   static bool available();
 
   inline QString routeName() const override {
-    return QString("Live Streaming From Socket CAN %1").arg(config.device);
+    return QString("Live Streaming From Socket CAN %1").arg(config.devices.join(", "));
   }
 
 protected:
   void streamThread() override;
   bool connect();
+  void closeSockets();
 
   SocketCanStreamConfig config = {};
-  std::unique_ptr<QCanBusDevice> device;
+  std::vector<int> sockets;
+  int epoll_fd = -1;
 };
 
 class OpenSocketCanWidget : public AbstractOpenStreamWidget {
@@ -42,6 +43,6 @@ public:
 private:
   void refreshDevices();
 
-  QComboBox *device_edit;
+  QListWidget *device_list;
   SocketCanStreamConfig config = {};
 };
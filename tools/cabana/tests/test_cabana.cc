@@ -1,9 +1,22 @@
 
 #undef INFO
+#include <numeric>
+
 #include <QDir>
+#include <QEventLoop>
+#include <QTimer>
+
+#ifdef __linux__
+#include <linux/can.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 #include "catch2/catch.hpp"
 #include "tools/cabana/dbc/dbcmanager.h"
+#include "tools/cabana/streams/abstractstream.h"
+#include "tools/cabana/streams/socketcanstream.h"
 
 const std::string TEST_RLOG_URL = "https://commadataci.blob.core.windows.net/openpilotci/0c94aa1e1296d7c6/2021-05-05--19-48-37/0/rlog.bz2";
 
@@ -155,3 +168,80 @@ TEST_CASE("parse_opendbc") {
   INFO(errors.join("\n").toStdString());
   REQUIRE(errors.empty());
 }
+
+TEST_CASE("CanData::compute") {
+  const MessageId id = {.source = 0, .address = 0x100};
+  const std::vector<uint8_t> no_mask;
+  const double freq = 100;
+  std::vector<uint8_t> dat(12, 0);
+
+  CanData data;
+  data.compute(id, dat.data(), dat.size(), 0, 1.0, no_mask, freq);
+  REQUIRE(data.dat == dat);
+  REQUIRE(data.colors.size() == dat.size());
+
+  // change bits in the second 8-byte lane and in the tail
+  dat[9] = 0b10000001;
+  dat[11] = 0b00000100;
+  data.compute(id, dat.data(), dat.size(), 1, 1.0, no_mask, freq);
+  data.updateColors();
+  REQUIRE(data.dat == dat);
+  for (int i = 0; i < dat.size(); ++i) {
+    const auto &counts = data.last_changes[i].bit_change_counts;
+    int total = std::accumulate(counts.begin(), counts.end(), 0);
+    REQUIRE(total == (i == 9 ? 2 : i == 11 ? 1 : 0));
+    REQUIRE((data.colors[i].alpha() > 0) == (i == 9 || i == 11));
+  }
+  REQUIRE(data.last_changes[9].bit_change_counts[0] == 1);
+  REQUIRE(data.last_changes[9].bit_change_counts[7] == 1);
+  REQUIRE(data.last_changes[11].bit_change_counts[5] == 1);
+
+  // colors fade out while the data does not change
+  const int alpha = data.colors[9].alpha();
+  for (int i = 0; i < 10; ++i) {
+    data.compute(id, dat.data(), dat.size(), 1 + (i + 1) * 0.01, 1.0, no_mask, freq);
+  }
+  data.updateColors();
+  REQUIRE(data.colors[9].alpha() < alpha);
+}
+
+#ifdef __linux__
+// needs a vcan interface: ip link add dev vcan0 type vcan && ip link set up vcan0
+TEST_CASE("SocketCanStream: frames keep their receive timestamps") {
+  const int ifindex = if_nametoindex("vcan0");
+  if (!SocketCanStream::available() || ifindex == 0) {
+    WARN("vcan0 not available, skipping");
+    return;
+  }
+  SocketCanStream stream(nullptr, {.devices = {"vcan0"}});
+
+  int fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  REQUIRE(fd >= 0);
+  struct sockaddr_can addr = {.can_family = AF_CAN, .can_ifindex = ifindex};
+  REQUIRE(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+  // sent before the stream thread starts, so all frames are read in one batch
+  const int frame_cnt = 5;
+  for (int i = 0; i < frame_cnt; ++i) {
+    struct can_frame frame = {};
+    frame.can_id = 0x100 + i;
+    frame.can_dlc = 8;
+    REQUIRE(write(fd, &frame, sizeof(frame)) == sizeof(frame));
+    usleep(20000);
+  }
+  close(fd);
+
+  stream.start();
+  QEventLoop loop;
+  QTimer::singleShot(500, &loop, &QEventLoop::quit);
+  loop.exec();
+  stream.stop();
+
+  const auto &events = stream.allEvents();
+  REQUIRE(events.size() == frame_cnt);
+  for (int i = 1; i < frame_cnt; ++i) {
+    REQUIRE(events[i]->address == 0x100 + i);
+    REQUIRE(events[i]->mono_time - events[i - 1]->mono_time >= 15e6);
+  }
+}
+#endif
@@ -58,7 +58,8 @@ class _LogFileReader:
       dat = bz2.decompress(dat)
     elif ext == ".zst" or dat.startswith(b'\x28\xB5\x2F\xFD'):
       # https://github.com/facebook/zstd/blob/dev/doc/zstd_compression_format.md#zstandard-frames
-      dat = zstd.decompress(dat)
+      # loggerd writes multiple frames without a content size, read all of them
+      dat = zstd.ZstdDecompressor().stream_reader(dat, read_across_frames=True).read()
 
     ents = capnp_log.Event.read_multiple_bytes(dat)
 